@@ -3,12 +3,16 @@
 #include <assert.h>
 #include <stdio.h>
 #include "app.h"
+#include "control.h"
+#include "decode.h"
 #include "macro.h"
 #include "param.h"
+#include "player.h"
 
 /* TODO: add SDL_GetError() strings to error messages */
 
-extern avparam_t avparam;
+
+static Uint32 event_type = (Uint32)-1;
 
 static bool reset_viewport(App *app) {
     int viewport_w, viewport_h;
@@ -37,20 +41,57 @@ static bool reset_viewport(App *app) {
     return true;
 }
 
+// playlist items can differ in shape, and the viewport
+// follows the frames
+bool app_set_aspect(App *app, const Rational *display_aspect) {
+    if (display_aspect->num == app->display_aspect.num &&
+            display_aspect->den == app->display_aspect.den)
+        return true;
+    app->display_aspect = *display_aspect;
+    SDL_DestroyTexture(app->tex);
+    return reset_viewport(app);
+}
+
+static void reset_vsync_interval(App *app) {
+    SDL_DisplayMode mode;
+    int rate = 60;
+    // the window may have moved to a display with a different
+    // refresh rate; fall back to 60Hz if the driver won't say
+    if (SDL_GetWindowDisplayMode(app->win, &mode) == 0 &&
+            mode.refresh_rate > 0)
+        rate = mode.refresh_rate;
+    app->vsync_interval = AV_TIME_BASE / rate;
+}
+
 bool app_init(App *app,
         SDL_AudioSpec *wanted_spec,
         Rational *display_aspect) {
-    app->pts = -1;
+    app->pts = AV_NOPTS_VALUE;
+    app->pts_speed = 1.0;
+    app->frame_pts = AV_NOPTS_VALUE;
+    app->av_offset = AV_NOPTS_VALUE;
+    app->seek_time = app->seek_latency = AV_NOPTS_VALUE;
+    app->audio_push = !wanted_spec->callback;
     app->display_aspect.num = display_aspect->num;
     app->display_aspect.den = display_aspect->den;
     app->volume = 1.0;
     app->width = 640;
     app->height = 480;
 
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
+    // SDL counts these, so each player can init and quit them
+    if (SDL_InitSubSystem(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
         LOG_ERROR("Error initializing SDL\n");
         return false;
     }
+    app->sdl_up = true;
+
+    // one event type does for all players
+    if (event_type == (Uint32)-1)
+        event_type = SDL_RegisterEvents(1);
+    if (event_type == (Uint32)-1) {
+        LOG_ERROR("Error registering user event\n");
+        return false;
+    }
 
     app->audio_devID = SDL_OpenAudioDevice(
             NULL, 0, wanted_spec, &app->audio_spec,
@@ -60,6 +101,11 @@ bool app_init(App *app,
         LOG_ERROR("Error opening audio device\n");
         return false;
     }
+    // until callbacks tell us otherwise, a buffer handed to the
+    // device plays once the one before it is done
+    app->audio_latency = (int64_t)app->audio_spec.samples *
+        AV_TIME_BASE / app->audio_spec.freq;
+    app->audio_callback_time = AV_NOPTS_VALUE;
 
     app->win = SDL_CreateWindow(
             "ffmpeg-player",
@@ -82,9 +128,10 @@ bool app_init(App *app,
 
     if (!reset_viewport(app))
         return false;
+    reset_vsync_interval(app);
 
-    SDL_PauseAudioDevice(app->audio_devID, 0);
-
+    // the device starts out paused; it's up to the caller
+    // to start it once there's something feeding it
     return true;
 }
 
@@ -101,51 +148,264 @@ void app_fini(App *app) {
         SDL_DestroyWindow(app->win);
         app->win = NULL;
     }
-    SDL_CloseAudioDevice(app->audio_devID);
-    SDL_Quit();
+    if (app->audio_devID) {
+        SDL_CloseAudioDevice(app->audio_devID);
+        app->audio_devID = 0;
+    }
+    if (app->sdl_up) {
+        SDL_QuitSubSystem(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
+        app->sdl_up = false;
+    }
+}
+
+void app_post_event(int code) {
+    if (event_type == (Uint32)-1)
+        return;
+    SDL_Event e = {};
+    e.type = event_type;
+    e.user.code = code;
+    // it's fine if this fails because the event queue is
+    // full: the main loop is awake then anyway
+    (void)SDL_PushEvent(&e);
+}
+
+int64_t app_clock(App *app) {
+    SDL_LockAudioDevice(app->audio_devID);
+    int64_t pts = app->pts;
+    int64_t elapsed = clock_now() - app->pts_time;
+    int64_t latency = app->audio_latency;
+    double speed = app->pts_speed;
+    Uint32 queued = app->audio_push
+        ? SDL_GetQueuedAudioSize(app->audio_devID) : 0;
+    SDL_UnlockAudioDevice(app->audio_devID);
+    if (pts == AV_NOPTS_VALUE)
+        return pts;
+    // in push mode, whatever is still queued hasn't been
+    // played yet, and SDL keeps track of that for us
+    if (app->audio_push)
+        return pts - (int64_t)(((double)queued * AV_TIME_BASE /
+                    app_audio_bytes_per_sec(app) + latency) * speed);
+    // interpolate between audio callbacks, but don't run further
+    // ahead than one callback interval in case the audio stalls
+    return pts + (int64_t)((min(elapsed, latency) - latency) * speed);
 }
 
-static void seek(App *app, int delta) {
+// seeks to pts (in AV_TIME_BASE units), and waits for the
+// fetch thread to get there
+void app_seek(App *app, int64_t pts, int flags, SeekMode mode) {
+    avparam_t *param = &app->player->avparam;
+    if (!param->seekable) {
+        fprintf(stderr, "Input is not seekable\n");
+        return;
+    }
+
+    // anything but a GOP decode leaves what the step cache
+    // holds behind, so stepping starts over from the next step;
+    // those are part of a step, not a seek of their own
+    if (mode != SEEK_GOP) {
+        param->stepping = false;
+        app->seek_time = clock_now();
+    }
+    param->seek_flags = flags;
+    param->seek_pts = pts;
+    param->seek_mode = mode;
+
+    ASSERT(SDL_LockMutex(param->seek_mtx) == 0);
+    param->do_seek = true;
+    param->seek_eof = false;
+    ASSERT(SDL_UnlockMutex(param->seek_mtx) == 0);
+    // the fetch thread may be blocked on a full queue or
+    // sleeping at EOF
+    fetch_wake(app->player);
+
+    // the fetch thread broadcasts seek_done on exit as well,
+    // so this can't wait forever if it died with an error
+    ASSERT(SDL_LockMutex(param->seek_mtx) == 0);
+    while (param->do_seek && !param->done)
+        ASSERT(SDL_CondWait(param->seek_done, param->seek_mtx) == 0);
+    ASSERT(SDL_UnlockMutex(param->seek_mtx) == 0);
+
+    // the audio thread only queues audio with the device locked
+    // and after checking it isn't from before the seek, so once
+    // cleared here, the queue stays clear of stale audio
+    SDL_LockAudioDevice(app->audio_devID);
+    app->pts = AV_NOPTS_VALUE;
+    if (app->audio_push)
+        SDL_ClearQueuedAudio(app->audio_devID);
+    SDL_UnlockAudioDevice(app->audio_devID);
+    jitter_break(&app->jitter);
+    if (mode != SEEK_GOP)
+        app->frame_due = app->paused;
+}
+
+static void seek(App *app, int64_t delta) {
+    avparam_t *param = &app->player->avparam;
+    // the clock isn't running again yet right after a seek,
+    // so go from where that one was headed; there's no clock
+    // at all when scrubbing, nor one that's any use after
+    // stepping, but the frame on screen will do
+    int64_t clock = app_clock(app);
+    if ((param->scrub || param->stepping) &&
+            app->frame_pts != AV_NOPTS_VALUE)
+        clock = app->frame_pts;
+    else if (clock == AV_NOPTS_VALUE)
+        clock = param->seek_pts;
+
     // although AVSEEK_FLAG_BACKWARD is ignored for
     // avformat_seek_file(), it's NOT ignored for
     // av_seek_frame(), so this flag is required
     // for seeking backward beyond a certain limit
-    avparam.seek_flags = delta < 0 ? AVSEEK_FLAG_BACKWARD : 0;
-    avparam.seek_pts = app->pts + delta;
-
-    ASSERT(SDL_LockMutex(avparam.seek_mtx) == 0);
-    avparam.do_seek = true;
-    while (avparam.do_seek) {
-        // instead of one (potentially infinite) wait, we wait
-        // in short spans, while checking if the fetch thread
-        // (which will service the seek) is still alive
-        // this is to account for the case when the fetch thread
-        // has exited because of some error, so we don't wait
-        // forever
-        int err = SDL_CondWaitTimeout(avparam.seek_done,
-                avparam.seek_mtx, DEFAULT_FRAME_DELAY);
-        ASSERT(err >= 0);
-        if (avparam.done) {
-            ASSERT(SDL_UnlockMutex(avparam.seek_mtx) == 0);
-            return;
-        }
-    }
-    ASSERT(SDL_UnlockMutex(avparam.seek_mtx) == 0);
-
-    app->pts = -1;
+    app_seek(app, clock + delta,
+            delta <= 0 ? AVSEEK_FLAG_BACKWARD : 0, SEEK_KEYFRAME);
 }
 
 static void toggle_pause(App *app) {
-    if (app->paused) {
-        app->paused = false;
-        SDL_PauseAudioDevice(app->audio_devID, 0);
+    avparam_t *param = &app->player->avparam;
+    jitter_break(&app->jitter);
+    app->paused = !app->paused;
+    // in push mode, the audio thread sleeps while paused
+    audio_ring_wake(&app->player->audio_ring);
+    // audio stays off while scrubbing
+    if (!param->scrub)
+        SDL_PauseAudioDevice(app->audio_devID, app->paused);
+    // the audio was off while stepping, and the decoder is off
+    // somewhere past the frame on screen, so pick up from there
+    if (!app->paused && param->stepping &&
+            app->frame_pts != AV_NOPTS_VALUE)
+        app_seek(app, app->frame_pts, AVSEEK_FLAG_BACKWARD, SEEK_EXACT);
+    param->stepping = false;
+}
+
+void app_set_paused(App *app, bool paused) {
+    if (app->paused != paused)
+        toggle_pause(app);
+}
+
+bool app_resize(App *app, int width, int height) {
+    //printf("%dx%d -> ", app->width, app->height);
+    app->width = width;
+    app->height = height;
+    //printf("%dx%d\n", app->width, app->height);
+    SDL_DestroyTexture(app->tex);
+    if (!reset_viewport(app))
+        return false;
+    reset_vsync_interval(app);
+    app->dirty = true;
+    return true;
+}
+
+// steps happen in present(), which has the frames
+static void step(App *app, int dir) {
+    avparam_t *param = &app->player->avparam;
+    if (param->scrub)
+        return;
+    if (!app->paused)
+        toggle_pause(app);
+    app->step = dir;
+}
+
+static const int scrub_rates[] = { 1, 2, 4, 8, 15, 30 };
+
+// scrubbing goes through keyframes only, without audio, at a
+// fixed rate; going in and out seeks to the frame on screen
+// to flush what was decoded the other way
+static void toggle_scrub(App *app) {
+    avparam_t *param = &app->player->avparam;
+    // with the audio off, the clock can't say where we are
+    // on the way out, so have seek() go from the frame
+    if (param->scrub && app->frame_pts != AV_NOPTS_VALUE)
+        param->seek_pts = app->frame_pts;
+    param->scrub = !param->scrub;
+    SDL_PauseAudioDevice(app->audio_devID, param->scrub || app->paused);
+    app->scrub_next = clock_now();
+    seek(app, 0);
+    printf("Scrub: %s\n", param->scrub ? "on" : "off");
+}
+
+static void scrub_direction(App *app, int dir) {
+    avparam_t *param = &app->player->avparam;
+    if (param->scrub_dir == dir)
+        return;
+    param->scrub_dir = dir;
+    // whatever was queued up is headed the wrong way
+    seek(app, 0);
+}
+
+static void scrub_rate(App *app, int dir) {
+    avparam_t *param = &app->player->avparam;
+    int n = SDL_arraysize(scrub_rates);
+    int i = 0;
+    while (i < n - 1 && scrub_rates[i] < param->scrub_rate)
+        i++;
+    i = dir > 0 ? min(i + 1, n - 1) : max(i - 1, 0);
+    param->scrub_rate = scrub_rates[i];
+    printf("Scrub rate: %d keyframes/s\n", param->scrub_rate);
+}
+
+// loop mode only matters at EOF, where the fetch thread
+// may be waiting already
+static void toggle_loop(App *app) {
+    avparam_t *param = &app->player->avparam;
+    param->loop = !param->loop;
+    fetch_wake(app->player);
+    printf("Loop: %s\n", param->loop ? "on" : "off");
+}
+
+// the first press marks A and the second B, going back to A
+// to repeat from there; the third stops repeating
+static void ab_repeat(App *app) {
+    avparam_t *param = &app->player->avparam;
+    if (app->frame_pts == AV_NOPTS_VALUE)
+        return;
+    int64_t pts = app->frame_pts - app->frame_offset;
+    if (param->ab_active) {
+        param->ab_active = false;
+        param->ab_a = param->ab_b = AV_NOPTS_VALUE;
+        printf("A-B repeat: off\n");
+    } else if (param->ab_a == AV_NOPTS_VALUE || pts <= param->ab_a) {
+        param->ab_a = pts;
+        printf("A-B repeat: A at %.3f s\n", pts / (double)AV_TIME_BASE);
     } else {
-        app->paused = true;
-        SDL_PauseAudioDevice(app->audio_devID, 1);
+        param->ab_b = pts;
+        param->ab_restart = true;
+        param->ab_active = true;
+        printf("A-B repeat: %.3f s to %.3f s\n",
+                param->ab_a / (double)AV_TIME_BASE,
+                pts / (double)AV_TIME_BASE);
+        // seek() works out where A is now
+        app_seek(app, app->frame_pts, AVSEEK_FLAG_BACKWARD, SEEK_EXACT);
     }
 }
 
-static void toggle_fullscreen(App *app) {
+static const double speeds[] = {
+    0.25, 0.5, 0.75, 1.0, 1.25, 1.5, 2.0, 3.0, 4.0,
+};
+
+// steps to the next speed up or down from the current one,
+// which may be off the list if it came from --speed
+static void change_speed(App *app, int dir) {
+    avparam_t *param = &app->player->avparam;
+    double speed = param->speed;
+    int n = SDL_arraysize(speeds);
+    if (dir > 0) {
+        for (int i = 0; i < n && speed == param->speed; i++)
+            if (speeds[i] > param->speed)
+                speed = speeds[i];
+    } else if (dir < 0) {
+        for (int i = n - 1; i >= 0 && speed == param->speed; i--)
+            if (speeds[i] < param->speed)
+                speed = speeds[i];
+    } else {
+        speed = 1.0;
+    }
+    if (speed == param->speed)
+        return;
+    param->speed = speed;
+    jitter_break(&app->jitter);
+    printf("Speed: %.2fx\n", speed);
+}
+
+void app_toggle_fullscreen(App *app) {
     if (!app->fullscreen) {
         SDL_SetWindowFullscreen(app->win, SDL_WINDOW_FULLSCREEN_DESKTOP);
     } else {
@@ -154,67 +414,112 @@ static void toggle_fullscreen(App *app) {
     app->fullscreen = !app->fullscreen;
 }
 
-bool process_events(App *app) {
-    SDL_Event e;
-    while (SDL_PollEvent(&e)) {
-        switch (e.type) {
-        case SDL_QUIT:
-            avparam.done = true;
-            break;
-        case SDL_KEYDOWN:
-            switch (e.key.keysym.sym) {
-            case SDLK_q:
-                avparam.done = true;
-                break;
-            case SDLK_SPACE:
-                toggle_pause(app);
-                break;
-            case SDLK_m:
-                app->muted = !app->muted;
-                break;
-            case SDLK_f:
-                toggle_fullscreen(app);
-                break;
-            case SDLK_9:
-                app->volume = max(app->volume - 0.05f, 0.0f);
-                break;
-            case SDLK_0:
-                app->volume = min(app->volume + 0.05f, 1.0f);
-                break;
-            case SDLK_RIGHT:
-                seek(app, 10000);
-                break;
-            case SDLK_LEFT:
-                seek(app, -10000);
-                break;
-            case SDLK_UP:
-                seek(app, 60000);
-                break;
-            case SDLK_DOWN:
-                seek(app, -60000);
-                break;
-            case SDLK_PAGEUP:
-                seek(app, 600000);
-                break;
-            case SDLK_PAGEDOWN:
-                seek(app, -600000);
-                break;
-            }
-            break;
-        case SDL_WINDOWEVENT:
-            if (e.window.event == SDL_WINDOWEVENT_RESIZED) {
-                //printf("%dx%d -> ", app->width, app->height);
-                app->width = e.window.data1;
-                app->height = e.window.data2;
-                //printf("%dx%d\n", app->width, app->height);
-                SDL_DestroyTexture(app->tex);
-                if (!reset_viewport(app))
-                    return false;
-            }
-            break;
-        default:
+// handles an event if it's for our window; with several
+// players in a process, each gets to see every event
+bool app_handle_event(App *app, const SDL_Event *e) {
+    avparam_t *param = &app->player->avparam;
+    Uint32 window = SDL_GetWindowID(app->win);
+    switch (e->type) {
+    case SDL_QUIT:
+        param->done = true;
+        break;
+    case SDL_KEYDOWN:
+        if (e->key.windowID != window)
+            break;
+        switch (e->key.keysym.sym) {
+        case SDLK_q:
+            param->done = true;
+            break;
+        case SDLK_SPACE:
+            toggle_pause(app);
+            break;
+        case SDLK_m:
+            app->muted = !app->muted;
+            break;
+        case SDLK_f:
+            app_toggle_fullscreen(app);
+            break;
+        case SDLK_9:
+            app->volume = max(app->volume - 0.05f, 0.0f);
+            break;
+        case SDLK_0:
+            app->volume = min(app->volume + 0.05f, 1.0f);
+            break;
+        case SDLK_s:
+            toggle_scrub(app);
+            break;
+        case SDLK_l:
+            toggle_loop(app);
+            break;
+        case SDLK_a:
+            ab_repeat(app);
+            break;
+        case SDLK_PERIOD:
+            step(app, 1);
+            break;
+        case SDLK_COMMA:
+            step(app, -1);
+            break;
+        case SDLK_LEFTBRACKET:
+            if (param->scrub)
+                scrub_rate(app, -1);
+            else
+                change_speed(app, -1);
+            break;
+        case SDLK_RIGHTBRACKET:
+            if (param->scrub)
+                scrub_rate(app, 1);
+            else
+                change_speed(app, 1);
+            break;
+        case SDLK_BACKSPACE:
+            change_speed(app, 0);
+            break;
+        case SDLK_RIGHT:
+            if (param->scrub)
+                scrub_direction(app, 1);
+            else
+                seek(app, 10 * AV_TIME_BASE);
+            break;
+        case SDLK_LEFT:
+            if (param->scrub)
+                scrub_direction(app, -1);
+            else
+                seek(app, -10 * AV_TIME_BASE);
+            break;
+        case SDLK_UP:
+            seek(app, 60 * AV_TIME_BASE);
+            break;
+        case SDLK_DOWN:
+            seek(app, -60 * AV_TIME_BASE);
+            break;
+        case SDLK_PAGEUP:
+            seek(app, 600 * AV_TIME_BASE);
+            break;
+        case SDLK_PAGEDOWN:
+            seek(app, -600 * AV_TIME_BASE);
             break;
         }
+        break;
+    case SDL_WINDOWEVENT:
+        if (e->window.windowID != window)
+            break;
+        if (e->window.event == SDL_WINDOWEVENT_CLOSE)
+            param->done = true;
+        if (e->window.event == SDL_WINDOWEVENT_EXPOSED)
+            app->dirty = true;
+        if (e->window.event == SDL_WINDOWEVENT_RESIZED &&
+                !app_resize(app, e->window.data1, e->window.data2))
+            return false;
+        break;
+    default:
+        // commands from the control socket get run here, on
+        // the main thread; our other events need no handling,
+        // they only wake us up so the main loop looks again
+        if (e->type == event_type && e->user.code == APP_EVENT_CONTROL &&
+                app->player->control)
+            control_run(app->player->control);
+        break;
     }
     return true;
 }
@@ -1,18 +1,69 @@
 #pragma once
 #include <SDL2/SDL.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include "clock.h"
+#include "param.h"
+
+typedef struct Player Player;
 
 typedef struct {
     int num;
     int den;
 } Rational;
 
+// codes for the user events other threads post
+// to wake up the main loop
+enum {
+    APP_EVENT_FRAME,    // a frame arrived in the empty video queue
+    APP_EVENT_CLOCK,    // the audio clock started running
+    APP_EVENT_DONE,     // the fetch thread exited
+    APP_EVENT_CONTROL,  // a command came in on the control socket
+    APP_EVENT_EOF,      // the fetch thread ran out of input after a seek
+};
+
 typedef struct {
-    long pts;
+    // the player this is the window and audio device of
+    Player *player;
+
+    // the audio clock: pts (in AV_TIME_BASE units) of the audio
+    // at the start of the last device buffer, and when (on the
+    // clock_now() clock) that buffer was requested, or
+    // AV_NOPTS_VALUE until it starts; in push mode, pts is
+    // that of the end of the audio queued so far
+    int64_t pts;
+    int64_t pts_time;
+    // the speed the audio at pts plays at; the clock
+    // advances that much faster than real time
+    double pts_speed;
     bool paused;
+    // pts of the frame on screen, and in scrub mode, when
+    // (on the clock_now() clock) the next one is due
+    int64_t frame_pts;
+    int64_t scrub_next;
+    // how far loops and repeats had moved that frame along
+    // from its time in the file
+    int64_t frame_offset;
+    // a frame step (1 or -1) waiting for present() to do it,
+    // and whether to show the frame a seek lands on even
+    // though we're paused
+    int step;
+    bool frame_due;
+    // set when the window must be redrawn even
+    // though no new frame is due
+    bool dirty;
 
     SDL_AudioDeviceID audio_devID;
     SDL_AudioSpec audio_spec;
+    // queue audio with SDL_QueueAudio() instead of having
+    // SDL pull it from a callback
+    bool audio_push;
+    // how long audio handed to the device takes to be heard,
+    // on top of what's queued in push mode; this follows the
+    // actual interval between callbacks, which can be longer
+    // than the buffer size suggests
+    int64_t audio_latency;
+    int64_t audio_callback_time;
     SDL_Window *win;
     SDL_Renderer *ren;
     SDL_Texture *tex;
@@ -26,13 +77,47 @@ typedef struct {
     float volume;
     bool muted;
 
+    // set once app_init() got SDL going, so app_fini() knows
+    // whether there's anything of ours to shut down
+    bool sdl_up;
+
     int width;
     int height;
     bool fullscreen;
+
+    // display refresh interval in us, used to line up
+    // presents with vsync
+    int64_t vsync_interval;
+    JitterStats jitter;
+
+    // frames taken off the queue but never shown, being late,
+    // and how far ahead of the clock (in us) the last one
+    // shown was, negative when it was late
+    uint64_t dropped;
+    int64_t av_offset;
+    // when (on the clock_now() clock) the last seek was asked
+    // for, until a frame from after it is on screen, and how
+    // long that took
+    int64_t seek_time;
+    int64_t seek_latency;
+    int64_t seek_latency_max;
+    uint64_t seeks;
 } App;
 
 bool app_init(App *app,
         SDL_AudioSpec *wanted_spec,
         Rational *display_aspect);
 void app_fini(App *app);
-bool process_events(App *app);
+bool app_set_aspect(App *app, const Rational *display_aspect);
+void app_post_event(int code);
+int64_t app_clock(App *app);
+void app_seek(App *app, int64_t pts, int flags, SeekMode mode);
+void app_set_paused(App *app, bool paused);
+bool app_resize(App *app, int width, int height);
+void app_toggle_fullscreen(App *app);
+bool app_handle_event(App *app, const SDL_Event *e);
+
+static inline int app_audio_bytes_per_sec(App *app) {
+    return app->audio_spec.freq * app->audio_spec.channels *
+        SDL_AUDIO_BITSIZE(app->audio_spec.format) / 8;
+}
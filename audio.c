@@ -0,0 +1,604 @@
+#include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+#include <SDL2/SDL.h>
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "audio.h"
+#include "dsp.h"
+#include "macro.h"
+
+// the channel layouts SDL takes as they are, which
+// use the same channel order as ffmpeg
+static const AVChannelLayout device_layouts[] = {
+    AV_CHANNEL_LAYOUT_MONO,
+    AV_CHANNEL_LAYOUT_STEREO,
+    AV_CHANNEL_LAYOUT_QUAD,
+    AV_CHANNEL_LAYOUT_5POINT1,
+    AV_CHANNEL_LAYOUT_5POINT1_BACK,
+    AV_CHANNEL_LAYOUT_7POINT1,
+};
+
+static const struct {
+    enum AVSampleFormat av;
+    SDL_AudioFormat sdl;
+} device_formats[] = {
+    { AV_SAMPLE_FMT_U8,  AUDIO_U8 },
+    { AV_SAMPLE_FMT_S16, AUDIO_S16SYS },
+    { AV_SAMPLE_FMT_S32, AUDIO_S32SYS },
+    { AV_SAMPLE_FMT_FLT, AUDIO_F32SYS },
+};
+
+void audio_wanted_spec(AVCodecContext *ctx, SDL_AudioSpec *spec) {
+    // anything SDL can't take as is gets downmixed to stereo
+    // and converted to float
+    spec->channels = 2;
+    for (size_t i = 0; i < SDL_arraysize(device_layouts); i++) {
+        if (av_channel_layout_compare(&ctx->ch_layout,
+                    &device_layouts[i]) == 0) {
+            spec->channels = device_layouts[i].nb_channels;
+            break;
+        }
+    }
+    spec->format = AUDIO_F32SYS;
+    enum AVSampleFormat packed = av_get_packed_sample_fmt(ctx->sample_fmt);
+    for (size_t i = 0; i < SDL_arraysize(device_formats); i++) {
+        if (device_formats[i].av == packed) {
+            spec->format = device_formats[i].sdl;
+            break;
+        }
+    }
+    spec->freq = ctx->sample_rate;
+}
+
+bool audio_conv_init(AudioConv *conv, const SDL_AudioSpec *spec,
+        const AVChannelLayout *source) {
+    memset(conv, 0, sizeof *conv);
+    conv->in_format = AV_SAMPLE_FMT_NONE;
+    conv->gain = 1.0f;
+
+    conv->format = AV_SAMPLE_FMT_NONE;
+    for (size_t i = 0; i < SDL_arraysize(device_formats); i++) {
+        if (device_formats[i].sdl == spec->format)
+            conv->format = device_formats[i].av;
+    }
+    if (conv->format == AV_SAMPLE_FMT_NONE) {
+        LOG_ERROR("Unsupported device format: %#x\n", spec->format);
+        return false;
+    }
+
+    // the stream's own layout, if the device took it, as several
+    // share a channel count (5.1 and 5.1(back)), and anything but
+    // the same one means resampling every frame
+    av_channel_layout_default(&conv->ch_layout, spec->channels);
+    for (size_t i = 0; i < SDL_arraysize(device_layouts); i++) {
+        if (source->nb_channels == spec->channels &&
+                av_channel_layout_compare(source, &device_layouts[i]) == 0) {
+            (void)av_channel_layout_copy(&conv->ch_layout, source);
+            conv->sample_rate = spec->freq;
+            return true;
+        }
+    }
+    for (size_t i = 0; i < SDL_arraysize(device_layouts); i++) {
+        if (device_layouts[i].nb_channels == spec->channels) {
+            (void)av_channel_layout_copy(&conv->ch_layout,
+                    &device_layouts[i]);
+            break;
+        }
+    }
+    conv->sample_rate = spec->freq;
+    return true;
+}
+
+void audio_conv_fini(AudioConv *conv) {
+    swr_free(&conv->swr);
+    av_channel_layout_uninit(&conv->ch_layout);
+    av_channel_layout_uninit(&conv->in_layout);
+    av_channel_layout_uninit(&conv->coef_layout);
+}
+
+#define INTERLEAVE(type)                                        \
+    for (int i = 0; i < frame->nb_samples; i++)                 \
+        for (int c = 0; c < nb_channels; c++)                   \
+            ((type *)out->data[0])[i * nb_channels + c] =       \
+                ((const type *)frame->extended_data[c])[i];
+
+// the only difference is planar vs. packed, which doesn't
+// take a resampler
+static AVFrame *interleave(AudioConv *conv, AVFrame *frame) {
+    _cleanup_(av_frame_free) AVFrame *out = av_frame_alloc();
+    if (!out) {
+        LOG_ERROR("Error allocating frame\n");
+        return NULL;
+    }
+    out->format = conv->format;
+    out->sample_rate = frame->sample_rate;
+    out->nb_samples = frame->nb_samples;
+    if (av_channel_layout_copy(&out->ch_layout, &frame->ch_layout) < 0 ||
+            av_frame_get_buffer(out, 0) < 0 ||
+            av_frame_copy_props(out, frame) < 0) {
+        LOG_ERROR("Error allocating frame\n");
+        return NULL;
+    }
+
+    int nb_channels = frame->ch_layout.nb_channels;
+    switch (av_get_bytes_per_sample(conv->format)) {
+    case 1: INTERLEAVE(uint8_t);  break;
+    case 2: INTERLEAVE(uint16_t); break;
+    case 4: INTERLEAVE(uint32_t); break;
+    default: assert(0);
+    }
+    return TAKE_PTR(out);
+}
+
+#undef INTERLEAVE
+
+// the usual coefficients for folding surround into stereo,
+// scaled down like swresample does so nothing can clip
+static void downmix_coefs(AudioConv *conv, const AVChannelLayout *layout) {
+    const float h = M_SQRT1_2;
+    float sum_l = 0, sum_r = 0;
+    for (int c = 0; c < layout->nb_channels; c++) {
+        float l = 0, r = 0;
+        switch (av_channel_layout_channel_from_index(layout, c)) {
+        case AV_CHAN_FRONT_LEFT:
+        case AV_CHAN_FRONT_LEFT_OF_CENTER:
+        case AV_CHAN_WIDE_LEFT:
+            l = 1;
+            break;
+        case AV_CHAN_FRONT_RIGHT:
+        case AV_CHAN_FRONT_RIGHT_OF_CENTER:
+        case AV_CHAN_WIDE_RIGHT:
+            r = 1;
+            break;
+        case AV_CHAN_FRONT_CENTER:
+            l = r = h;
+            break;
+        case AV_CHAN_BACK_LEFT:
+        case AV_CHAN_SIDE_LEFT:
+        case AV_CHAN_SURROUND_DIRECT_LEFT:
+            l = h;
+            break;
+        case AV_CHAN_BACK_RIGHT:
+        case AV_CHAN_SIDE_RIGHT:
+        case AV_CHAN_SURROUND_DIRECT_RIGHT:
+            r = h;
+            break;
+        case AV_CHAN_BACK_CENTER:
+            l = r = 0.5f;
+            break;
+        default:
+            // LFE and height channels are dropped
+            break;
+        }
+        conv->coef_l[c] = l;
+        conv->coef_r[c] = r;
+        sum_l += l;
+        sum_r += r;
+    }
+    float scale = max(sum_l, sum_r);
+    if (scale > 1) {
+        for (int c = 0; c < layout->nb_channels; c++) {
+            conv->coef_l[c] /= scale;
+            conv->coef_r[c] /= scale;
+        }
+    }
+    (void)av_channel_layout_copy(&conv->coef_layout, layout);
+}
+
+// planar float surround going to a stereo float device, which
+// is common enough (AAC, AC-3 and Opus all decode to planar
+// float) to be worth doing without the resampler
+static AVFrame *downmix(AudioConv *conv, AVFrame *frame) {
+    _cleanup_(av_frame_free) AVFrame *out = av_frame_alloc();
+    if (!out) {
+        LOG_ERROR("Error allocating frame\n");
+        return NULL;
+    }
+    out->format = conv->format;
+    out->sample_rate = frame->sample_rate;
+    out->nb_samples = frame->nb_samples;
+    if (av_channel_layout_copy(&out->ch_layout, &conv->ch_layout) < 0 ||
+            av_frame_get_buffer(out, 0) < 0 ||
+            av_frame_copy_props(out, frame) < 0) {
+        LOG_ERROR("Error allocating frame\n");
+        return NULL;
+    }
+
+    if (av_channel_layout_compare(&frame->ch_layout,
+                &conv->coef_layout) != 0)
+        downmix_coefs(conv, &frame->ch_layout);
+    dsp_downmix_f32((float *)out->data[0],
+            (const float *const *)frame->extended_data,
+            frame->ch_layout.nb_channels, frame->nb_samples,
+            conv->coef_l, conv->coef_r);
+    return TAKE_PTR(out);
+}
+
+static AVFrame *resample(AudioConv *conv, AVFrame *frame) {
+    int err;
+
+    if (!conv->swr ||
+            frame->format != conv->in_format ||
+            frame->sample_rate != conv->in_rate ||
+            av_channel_layout_compare(&frame->ch_layout,
+                &conv->in_layout) != 0) {
+        swr_free(&conv->swr);
+        err = swr_alloc_set_opts2(&conv->swr,
+                &conv->ch_layout,
+                conv->format,
+                conv->sample_rate,
+                &frame->ch_layout,
+                frame->format,
+                frame->sample_rate,
+                0,
+                NULL
+                );
+        if (err < 0 || swr_init(conv->swr) < 0) {
+            LOG_ERROR("Error initializing swresample context\n");
+            swr_free(&conv->swr);
+            return NULL;
+        }
+        conv->in_format = frame->format;
+        conv->in_rate = frame->sample_rate;
+        (void)av_channel_layout_copy(&conv->in_layout, &frame->ch_layout);
+    }
+
+    _cleanup_(av_frame_free) AVFrame *out = av_frame_alloc();
+    if (!out) {
+        LOG_ERROR("Error allocating frame\n");
+        return NULL;
+    }
+    out->format = conv->format;
+    out->sample_rate = conv->sample_rate;
+    if (av_channel_layout_copy(&out->ch_layout, &conv->ch_layout) < 0) {
+        LOG_ERROR("Error copying channel layout\n");
+        return NULL;
+    }
+    err = swr_convert_frame(conv->swr, out, frame);
+    if (err < 0) {
+        LOG_ERROR("Error resampling frame: %s\n", av_err2str(err));
+        return NULL;
+    }
+    (void)av_frame_copy_props(out, frame);
+    return TAKE_PTR(out);
+}
+
+// takes ownership of frame, and returns it in the device
+// format, or NULL on error; when the formats already match,
+// that's the very same frame
+AVFrame *audio_convert(AudioConv *conv, AVFrame *frame) {
+    _cleanup_(av_frame_free) AVFrame *in = frame;
+
+    bool same_layout = av_channel_layout_compare(&in->ch_layout,
+            &conv->ch_layout) == 0;
+    bool same_rate = in->sample_rate == conv->sample_rate;
+    if (same_layout && same_rate) {
+        if (in->format == conv->format) {
+            conv->passed++;
+            return TAKE_PTR(in);
+        }
+        // a single plane is as good as packed
+        if (av_get_packed_sample_fmt(in->format) == conv->format &&
+                in->ch_layout.nb_channels == 1) {
+            conv->passed++;
+            return TAKE_PTR(in);
+        }
+        if (av_get_packed_sample_fmt(in->format) == conv->format) {
+            conv->interleaved++;
+            return interleave(conv, in);
+        }
+    }
+    if (same_rate && in->format == AV_SAMPLE_FMT_FLTP &&
+            conv->format == AV_SAMPLE_FMT_FLT &&
+            conv->ch_layout.nb_channels == 2 &&
+            in->ch_layout.nb_channels > 2 &&
+            in->ch_layout.nb_channels <= AUDIO_DOWNMIX_MAX) {
+        conv->downmixed++;
+        return downmix(conv, in);
+    }
+    conv->resampled++;
+    return resample(conv, in);
+}
+
+// scales a frame in the device format by gain, ramping from the
+// previous frame's gain so volume changes don't click
+bool audio_apply_gain(AudioConv *conv, AVFrame *frame, float gain) {
+    float g0 = conv->gain;
+    conv->gain = gain;
+    if (g0 == 1.0f && gain == 1.0f)
+        return true;
+    if (av_frame_make_writable(frame) < 0) {
+        LOG_ERROR("Error making frame writable\n");
+        return false;
+    }
+
+    int n = frame->nb_samples * conv->ch_layout.nb_channels;
+    switch (conv->format) {
+    case AV_SAMPLE_FMT_U8:
+        dsp_gain_u8(frame->data[0], n, g0, gain);
+        break;
+    case AV_SAMPLE_FMT_S16:
+        dsp_gain_s16((int16_t *)frame->data[0], n, g0, gain);
+        break;
+    case AV_SAMPLE_FMT_S32:
+        dsp_gain_s32((int32_t *)frame->data[0], n, g0, gain);
+        break;
+    case AV_SAMPLE_FMT_FLT:
+        dsp_gain_f32((float *)frame->data[0], n, g0, gain);
+        break;
+    default:
+        assert(0);
+    }
+    return true;
+}
+
+void audio_tempo_reset(AudioTempo *tempo) {
+    avfilter_graph_free(&tempo->graph);
+    tempo->src = tempo->sink = NULL;
+}
+
+static inline void inout_freep(AVFilterInOut **pinout) {
+    avfilter_inout_free(pinout);
+}
+
+static bool tempo_init(AudioTempo *tempo, AudioConv *conv, double speed) {
+    char layout[64];
+    char args[256];
+    char filters[64];
+    (void)av_channel_layout_describe(&conv->ch_layout,
+            layout, sizeof layout);
+    snprintf(args, sizeof args,
+            "time_base=1/%d:sample_rate=%d:sample_fmt=%s:channel_layout=%s",
+            conv->sample_rate, conv->sample_rate,
+            av_get_sample_fmt_name(conv->format), layout);
+    // older versions of atempo only go down to 0.5
+    if (speed < 0.5)
+        snprintf(filters, sizeof filters,
+                "atempo=0.5,atempo=%f", speed / 0.5);
+    else
+        snprintf(filters, sizeof filters, "atempo=%f", speed);
+
+    tempo->graph = avfilter_graph_alloc();
+    if (!tempo->graph) {
+        LOG_ERROR("Error allocating filter graph\n");
+        return false;
+    }
+    if (avfilter_graph_create_filter(&tempo->src,
+                avfilter_get_by_name("abuffer"),
+                "in", args, NULL, tempo->graph) < 0 ||
+            avfilter_graph_create_filter(&tempo->sink,
+                avfilter_get_by_name("abuffersink"),
+                "out", NULL, NULL, tempo->graph) < 0) {
+        LOG_ERROR("Error creating buffer filters\n");
+        audio_tempo_reset(tempo);
+        return false;
+    }
+
+    _cleanup_(inout_freep) AVFilterInOut *outputs = avfilter_inout_alloc();
+    _cleanup_(inout_freep) AVFilterInOut *inputs = avfilter_inout_alloc();
+    if (!outputs || !inputs) {
+        LOG_ERROR("Error allocating filter graph\n");
+        audio_tempo_reset(tempo);
+        return false;
+    }
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = tempo->src;
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = tempo->sink;
+    int err = avfilter_graph_parse_ptr(tempo->graph, filters,
+            &inputs, &outputs, NULL);
+    if (err >= 0)
+        err = avfilter_graph_config(tempo->graph, NULL);
+    if (err < 0) {
+        LOG_ERROR("Error setting up atempo: %s\n", av_err2str(err));
+        audio_tempo_reset(tempo);
+        return false;
+    }
+    // atempo takes packed formats as they are, so this
+    // shouldn't happen, but the device can't take anything else
+    if (av_buffersink_get_format(tempo->sink) != conv->format) {
+        LOG_ERROR("atempo changed the sample format\n");
+        audio_tempo_reset(tempo);
+        return false;
+    }
+    tempo->speed = speed;
+    tempo->base_pts = AV_NOPTS_VALUE;
+    tempo->nb_in = tempo->nb_out = 0;
+    return true;
+}
+
+// feeds a frame in the device format to the stretcher, which
+// takes ownership of it; a speed change starts over with a new
+// graph, dropping what the old one still held
+bool audio_tempo_send(AudioTempo *tempo, AudioConv *conv,
+        AVFrame *frame, int64_t pts, double speed) {
+    _cleanup_(av_frame_free) AVFrame *in = frame;
+    if (tempo->graph && tempo->speed != speed)
+        audio_tempo_reset(tempo);
+    if (!tempo->graph && !tempo_init(tempo, conv, speed))
+        return false;
+
+    if (tempo->base_pts == AV_NOPTS_VALUE && tempo->nb_in == 0)
+        tempo->base_pts = pts;
+    in->pts = tempo->nb_in;
+    tempo->nb_in += in->nb_samples;
+    int err = av_buffersrc_add_frame(tempo->src, in);
+    if (err < 0) {
+        LOG_ERROR("Error feeding atempo: %s\n", av_err2str(err));
+        return false;
+    }
+    tempo->stretched++;
+    return true;
+}
+
+// returns the next stretched frame, if any, with its pts
+// (in the stream's timeline) in *pts
+AVFrame *audio_tempo_receive(AudioTempo *tempo, int64_t *pts) {
+    if (!tempo->graph)
+        return NULL;
+    _cleanup_(av_frame_free) AVFrame *out = av_frame_alloc();
+    if (!out) {
+        LOG_ERROR("Error allocating frame\n");
+        return NULL;
+    }
+    int err = av_buffersink_get_frame(tempo->sink, out);
+    if (err < 0) {
+        if (err != AVERROR(EAGAIN) && err != AVERROR_EOF)
+            LOG_ERROR("Error reading from atempo: %s\n", av_err2str(err));
+        return NULL;
+    }
+    // each second out is speed seconds of the stream
+    *pts = tempo->base_pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE
+        : tempo->base_pts + (int64_t)(tempo->nb_out * tempo->speed *
+                AV_TIME_BASE / out->sample_rate);
+    tempo->nb_out += out->nb_samples;
+    return TAKE_PTR(out);
+}
+
+void audio_print_stats(AudioConv *conv, AudioTempo *tempo,
+        AudioRing *ring, FILE *fp) {
+    fprintf(fp, "audio: %llu frames passed through, "
+            "%llu interleaved, %llu downmixed, %llu resampled, "
+            "%llu stretched, %llu underruns\n",
+            (unsigned long long)conv->passed,
+            (unsigned long long)conv->interleaved,
+            (unsigned long long)conv->downmixed,
+            (unsigned long long)conv->resampled,
+            (unsigned long long)tempo->stretched,
+            (unsigned long long)ring->underruns);
+}
+
+bool audio_ring_init(AudioRing *ring, int size) {
+    memset(ring, 0, sizeof *ring);
+    ring->data = malloc(size);
+    ring->size = size;
+    ring->mutex = SDL_CreateMutex();
+    ring->space = SDL_CreateCond();
+    return ring->data && ring->mutex && ring->space;
+}
+
+void audio_ring_fini(AudioRing *ring) {
+    free(ring->data);
+    SDL_DestroyMutex(ring->mutex);
+    SDL_DestroyCond(ring->space);
+}
+
+unsigned audio_ring_gen(AudioRing *ring) {
+    ASSERT(SDL_LockMutex(ring->mutex) == 0);
+    unsigned gen = ring->gen;
+    ASSERT(SDL_UnlockMutex(ring->mutex) == 0);
+    return gen;
+}
+
+// blocks until all of data is in, and returns false if the
+// ring was flushed (since gen was read) or shut down meanwhile
+bool audio_ring_write(AudioRing *ring, const uint8_t *data, int len,
+        int64_t pts, double speed, unsigned gen) {
+    ASSERT(SDL_LockMutex(ring->mutex) == 0);
+    // with the marks all taken, the pts of this frame
+    // is extrapolated from an earlier one
+    if (pts != AV_NOPTS_VALUE && ring->gen == gen &&
+            ring->mark_count < AUDIO_RING_MARKS) {
+        int i = (ring->mark_start + ring->mark_count) % AUDIO_RING_MARKS;
+        ring->marks[i].pos = ring->written;
+        ring->marks[i].pts = pts;
+        ring->marks[i].speed = speed;
+        ring->mark_count++;
+    }
+    while (len > 0) {
+        while (ring->count == ring->size && ring->gen == gen && !ring->quit)
+            ASSERT(SDL_CondWait(ring->space, ring->mutex) == 0);
+        if (ring->gen != gen || ring->quit) {
+            ASSERT(SDL_UnlockMutex(ring->mutex) == 0);
+            return false;
+        }
+        int tail = (ring->start + ring->count) % ring->size;
+        int n = min(len, min(ring->size - ring->count, ring->size - tail));
+        memcpy(&ring->data[tail], data, n);
+        ring->count += n;
+        ring->written += n;
+        data += n;
+        len -= n;
+    }
+    ASSERT(SDL_UnlockMutex(ring->mutex) == 0);
+    return true;
+}
+
+// fills dst, padding with silence if the ring runs dry, and
+// returns the pts of its first byte, or AV_NOPTS_VALUE if
+// there was nothing to play; *speed is the speed it plays at
+int64_t audio_ring_read(AudioRing *ring, uint8_t *dst, int len,
+        uint8_t silence, int bytes_per_sec, double *speed) {
+    ASSERT(SDL_LockMutex(ring->mutex) == 0);
+    while (ring->mark_count > 1 &&
+            ring->marks[(ring->mark_start + 1) % AUDIO_RING_MARKS].pos <=
+            ring->read) {
+        ring->mark_start = (ring->mark_start + 1) % AUDIO_RING_MARKS;
+        ring->mark_count--;
+    }
+    int64_t pts = AV_NOPTS_VALUE;
+    if (ring->count > 0 && ring->mark_count > 0) {
+        uint64_t pos = ring->marks[ring->mark_start].pos;
+        if (pos <= ring->read) {
+            *speed = ring->marks[ring->mark_start].speed;
+            pts = ring->marks[ring->mark_start].pts + (int64_t)(
+                    (ring->read - pos) * *speed * AV_TIME_BASE /
+                    bytes_per_sec);
+        }
+    }
+
+    int done = 0;
+    while (done < len && ring->count > 0) {
+        int n = min(len - done, min(ring->count, ring->size - ring->start));
+        memcpy(&dst[done], &ring->data[ring->start], n);
+        ring->start = (ring->start + n) % ring->size;
+        ring->count -= n;
+        ring->read += n;
+        done += n;
+    }
+    if (done < len) {
+        memset(&dst[done], silence, len - done);
+        // count each dry spell once, not every buffer of it
+        if (!ring->dry && ring->read > 0)
+            ring->underruns++;
+        ring->dry = true;
+    } else {
+        ring->dry = false;
+    }
+    ASSERT(SDL_CondSignal(ring->space) == 0);
+    ASSERT(SDL_UnlockMutex(ring->mutex) == 0);
+    return pts;
+}
+
+void audio_ring_flush(AudioRing *ring) {
+    ASSERT(SDL_LockMutex(ring->mutex) == 0);
+    ring->start = ring->count = 0;
+    ring->mark_start = ring->mark_count = 0;
+    ring->written = ring->read = 0;
+    ring->dry = false;
+    ring->gen++;
+    ASSERT(SDL_CondSignal(ring->space) == 0);
+    ASSERT(SDL_UnlockMutex(ring->mutex) == 0);
+}
+
+// wakes a writer waiting on the ring, to look again at whatever
+// it's waiting for
+void audio_ring_wake(AudioRing *ring) {
+    ASSERT(SDL_LockMutex(ring->mutex) == 0);
+    ASSERT(SDL_CondSignal(ring->space) == 0);
+    ASSERT(SDL_UnlockMutex(ring->mutex) == 0);
+}
+
+void audio_ring_quit(AudioRing *ring) {
+    ASSERT(SDL_LockMutex(ring->mutex) == 0);
+    ring->quit = true;
+    ASSERT(SDL_CondSignal(ring->space) == 0);
+    ASSERT(SDL_UnlockMutex(ring->mutex) == 0);
+}
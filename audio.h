@@ -0,0 +1,101 @@
+#pragma once
+#include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libswresample/swresample.h>
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define AUDIO_DOWNMIX_MAX 16
+#define AUDIO_RING_MARKS 64
+
+// converts decoded audio to what the device takes,
+// doing as little work as the formats allow
+typedef struct {
+    // the device format, always packed
+    AVChannelLayout ch_layout;
+    enum AVSampleFormat format;
+    int sample_rate;
+
+    // the resampler, and the input it's set up for; it's kept
+    // across frames so it can carry its state over
+    SwrContext *swr;
+    AVChannelLayout in_layout;
+    enum AVSampleFormat in_format;
+    int in_rate;
+
+    // downmix coefficients for in_layout, when it's planar float
+    // going to a stereo float device
+    float coef_l[AUDIO_DOWNMIX_MAX], coef_r[AUDIO_DOWNMIX_MAX];
+    AVChannelLayout coef_layout;
+
+    // the gain last applied, which the next frame ramps from
+    float gain;
+
+    uint64_t passed, interleaved, downmixed, resampled;
+} AudioConv;
+
+// time-stretches converted audio with atempo, for playing
+// at other speeds without changing the pitch
+typedef struct {
+    AVFilterGraph *graph;
+    AVFilterContext *src, *sink;
+    double speed;       // what the graph is set up for
+    // the pts of the first sample in, and how many samples came
+    // out since, which is what output pts are counted from
+    int64_t base_pts;
+    int64_t nb_in, nb_out;
+    uint64_t stretched;
+} AudioTempo;
+
+// converted audio on its way to the device, along with the
+// pts of the frames it came from
+typedef struct {
+    uint8_t *data;
+    int size, start, count;
+    // byte positions (counted since the last flush) where
+    // frames start, and their pts
+    struct {
+        uint64_t pos;
+        int64_t pts;
+        double speed;
+    } marks[AUDIO_RING_MARKS];
+    int mark_start, mark_count;
+    uint64_t written, read;
+    // bumped on every flush, so a writer can tell its
+    // data got stale while it was blocked
+    unsigned gen;
+    bool quit;
+    bool dry;
+    uint64_t underruns;
+
+    SDL_mutex *mutex;
+    SDL_cond *space;
+} AudioRing;
+
+void audio_wanted_spec(AVCodecContext *ctx, SDL_AudioSpec *spec);
+// source is the layout of the stream the device was opened for
+bool audio_conv_init(AudioConv *conv, const SDL_AudioSpec *spec,
+        const AVChannelLayout *source);
+void audio_conv_fini(AudioConv *conv);
+AVFrame *audio_convert(AudioConv *conv, AVFrame *frame);
+bool audio_apply_gain(AudioConv *conv, AVFrame *frame, float gain);
+void audio_tempo_reset(AudioTempo *tempo);
+bool audio_tempo_send(AudioTempo *tempo, AudioConv *conv,
+        AVFrame *frame, int64_t pts, double speed);
+AVFrame *audio_tempo_receive(AudioTempo *tempo, int64_t *pts);
+
+void audio_print_stats(AudioConv *conv, AudioTempo *tempo,
+        AudioRing *ring, FILE *fp);
+
+bool audio_ring_init(AudioRing *ring, int size);
+void audio_ring_fini(AudioRing *ring);
+unsigned audio_ring_gen(AudioRing *ring);
+bool audio_ring_write(AudioRing *ring, const uint8_t *data, int len,
+        int64_t pts, double speed, unsigned gen);
+int64_t audio_ring_read(AudioRing *ring, uint8_t *dst, int len,
+        uint8_t silence, int bytes_per_sec, double *speed);
+void audio_ring_flush(AudioRing *ring);
+void audio_ring_wake(AudioRing *ring);
+void audio_ring_quit(AudioRing *ring);
@@ -0,0 +1,190 @@
+#include <libavutil/frame.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+#include "macro.h"
+
+bool frame_cache_init(FrameCache *cache, size_t max_bytes) {
+    memset(cache, 0, sizeof *cache);
+    cache->max_bytes = max_bytes;
+    cache->capacity = 64;
+    cache->entries = malloc(cache->capacity * sizeof *cache->entries);
+    return cache->entries != NULL;
+}
+
+void frame_cache_fini(FrameCache *cache) {
+    frame_cache_clear(cache);
+    free(cache->entries);
+    cache->entries = NULL;
+}
+
+void frame_cache_clear(FrameCache *cache) {
+    for (int i = 0; i < cache->count; i++)
+        av_frame_free(&cache->entries[i].frame);
+    cache->count = 0;
+    cache->bytes = 0;
+}
+
+static size_t frame_size(AVFrame *frame) {
+    size_t size = 0;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++)
+        size += frame->buf[i]->size;
+    return size;
+}
+
+// index of the first entry with a pts not below pts
+static int lower_bound(FrameCache *cache, int64_t pts) {
+    int lo = 0, hi = cache->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cache->entries[mid].pts < pts)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void remove_entry(FrameCache *cache, int i) {
+    cache->bytes -= cache->entries[i].size;
+    av_frame_free(&cache->entries[i].frame);
+    memmove(&cache->entries[i], &cache->entries[i + 1],
+            (cache->count - i - 1) * sizeof *cache->entries);
+    cache->count--;
+}
+
+// takes ownership of frame; when over budget, the frames
+// furthest from center go first, which may be this one
+void frame_cache_add(FrameCache *cache, AVFrame *frame, int64_t pts,
+        int64_t center) {
+    int i = lower_bound(cache, pts);
+    if (i < cache->count && cache->entries[i].pts == pts) {
+        av_frame_free(&frame);
+        return;
+    }
+    if (cache->count == cache->capacity) {
+        int capacity = cache->capacity * 2;
+        void *entries = realloc(cache->entries,
+                capacity * sizeof *cache->entries);
+        if (!entries) {
+            av_frame_free(&frame);
+            return;
+        }
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    memmove(&cache->entries[i + 1], &cache->entries[i],
+            (cache->count - i) * sizeof *cache->entries);
+    cache->entries[i].pts = pts;
+    cache->entries[i].size = frame_size(frame);
+    cache->entries[i].frame = frame;
+    cache->bytes += cache->entries[i].size;
+    cache->count++;
+
+    while (cache->bytes > cache->max_bytes && cache->count > 0) {
+        int64_t first = llabs(cache->entries[0].pts - center);
+        int64_t last = llabs(cache->entries[cache->count - 1].pts - center);
+        remove_entry(cache, first >= last ? 0 : cache->count - 1);
+        cache->evicted++;
+    }
+}
+
+// these return a new reference to the frame right before or
+// after pts, or NULL if it isn't cached
+
+AVFrame *frame_cache_prev(FrameCache *cache, int64_t pts) {
+    int i = lower_bound(cache, pts) - 1;
+    if (i < 0) {
+        cache->misses++;
+        return NULL;
+    }
+    cache->hits++;
+    return av_frame_clone(cache->entries[i].frame);
+}
+
+AVFrame *frame_cache_next(FrameCache *cache, int64_t pts) {
+    int i = lower_bound(cache, pts + 1);
+    if (i == cache->count) {
+        cache->misses++;
+        return NULL;
+    }
+    cache->hits++;
+    return av_frame_clone(cache->entries[i].frame);
+}
+
+void frame_cache_print_stats(FrameCache *cache, FILE *fp) {
+    if (cache->hits + cache->misses == 0)
+        return;
+    fprintf(fp, "step cache: %llu hits, %llu misses, %llu evicted, "
+            "%d frames (%.1f MiB) cached\n",
+            (unsigned long long)cache->hits,
+            (unsigned long long)cache->misses,
+            (unsigned long long)cache->evicted,
+            cache->count, cache->bytes / (1024.0 * 1024.0));
+}
+
+bool segment_init(Segment *seg, size_t max_bytes) {
+    memset(seg, 0, sizeof *seg);
+    seg->max_bytes = max_bytes;
+    seg->video_end = seg->audio_end = AV_NOPTS_VALUE;
+    return true;
+}
+
+void segment_fini(Segment *seg) {
+    segment_clear(seg);
+    free(seg->frames);
+    seg->frames = NULL;
+    seg->capacity = 0;
+}
+
+void segment_clear(Segment *seg) {
+    for (int i = 0; i < seg->count; i++)
+        av_frame_free(&seg->frames[i].frame);
+    seg->count = 0;
+    seg->bytes = 0;
+    seg->recording = false;
+    seg->complete = false;
+    seg->video_end = seg->audio_end = AV_NOPTS_VALUE;
+}
+
+// takes ownership of frame, whose pts and end are in AV_TIME_BASE
+// units; returns false, and stops recording, once it's full
+bool segment_add(Segment *seg, AVFrame *frame, int stream_index,
+        bool video, int64_t pts, int64_t end) {
+    size_t size = frame_size(frame);
+    if (seg->bytes + size > seg->max_bytes) {
+        av_frame_free(&frame);
+        seg->recording = false;
+        return false;
+    }
+    if (seg->count == seg->capacity) {
+        int capacity = max(seg->capacity * 2, 256);
+        void *frames = realloc(seg->frames, capacity * sizeof *seg->frames);
+        if (!frames) {
+            av_frame_free(&frame);
+            seg->recording = false;
+            return false;
+        }
+        seg->frames = frames;
+        seg->capacity = capacity;
+    }
+    seg->frames[seg->count].frame = frame;
+    seg->frames[seg->count].stream_index = stream_index;
+    seg->count++;
+    seg->bytes += size;
+    if (video)
+        seg->video_end = pts;
+    else
+        seg->audio_end = end;
+    return true;
+}
+
+void segment_print_stats(Segment *seg, const char *name, FILE *fp) {
+    if (seg->replays == 0)
+        return;
+    fprintf(fp, "%s: replayed %llu times from memory, "
+            "%d frames (%.1f MiB)%s\n", name,
+            (unsigned long long)seg->replays, seg->count,
+            seg->bytes / (1024.0 * 1024.0),
+            seg->complete ? "" : ", partial");
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct AVFrame AVFrame;
+
+// decoded frames kept around for stepping, sorted by pts (in
+// AV_TIME_BASE units) and bounded by the memory they take up;
+// like the queue, it does no locking of its own
+typedef struct {
+    struct {
+        int64_t pts;
+        size_t size;
+        AVFrame *frame;
+    } *entries;
+    int count, capacity;
+    size_t bytes, max_bytes;
+    uint64_t hits, misses, evicted;
+} FrameCache;
+
+bool frame_cache_init(FrameCache *cache, size_t max_bytes);
+void frame_cache_fini(FrameCache *cache);
+void frame_cache_clear(FrameCache *cache);
+void frame_cache_add(FrameCache *cache, AVFrame *frame, int64_t pts,
+        int64_t center);
+AVFrame *frame_cache_prev(FrameCache *cache, int64_t pts);
+AVFrame *frame_cache_next(FrameCache *cache, int64_t pts);
+void frame_cache_print_stats(FrameCache *cache, FILE *fp);
+
+// a run of decoded frames from both streams, in decode order, kept
+// to be played again; timestamps are the file's own, and the run
+// is bounded by the memory it takes up
+typedef struct {
+    struct {
+        AVFrame *frame;
+        int stream_index;
+    } *frames;
+    int count, capacity;
+    size_t bytes, max_bytes;
+    // recording stops when the segment fills up; it's complete
+    // if it got to the end of what it was meant to hold
+    bool recording;
+    bool complete;
+    // pts of the last video frame, and where the audio ends
+    int64_t video_end, audio_end;
+    uint64_t replays;
+} Segment;
+
+bool segment_init(Segment *seg, size_t max_bytes);
+void segment_fini(Segment *seg);
+void segment_clear(Segment *seg);
+bool segment_add(Segment *seg, AVFrame *frame, int stream_index,
+        bool video, int64_t pts, int64_t end);
+void segment_print_stats(Segment *seg, const char *name, FILE *fp);
@@ -0,0 +1,58 @@
+#include <SDL2/SDL.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "clock.h"
+
+// intervals further off than this are a seek or a
+// stall, not jitter, and would swamp the statistics
+#define JITTER_MAX_INTERVAL 1000000
+
+int64_t clock_now(void) {
+    static Uint64 freq = 0;
+    if (!freq)
+        freq = SDL_GetPerformanceFrequency();
+    Uint64 count = SDL_GetPerformanceCounter();
+    // split the conversion so it can't overflow
+    return (int64_t)(count / freq * 1000000 +
+            count % freq * 1000000 / freq);
+}
+
+void jitter_break(JitterStats *stats) {
+    stats->valid = false;
+}
+
+void jitter_update(JitterStats *stats, int64_t now, int64_t pts) {
+    int64_t interval = now - stats->last;
+    int64_t expected = pts - stats->last_pts;
+    bool use = stats->valid &&
+        expected > 0 && expected < JITTER_MAX_INTERVAL;
+
+    stats->valid = true;
+    stats->last = now;
+    stats->last_pts = pts;
+    if (!use)
+        return;
+
+    double jitter = interval - expected;
+    stats->count++;
+    double delta = jitter - stats->mean;
+    stats->mean += delta / stats->count;
+    stats->m2 += delta * (jitter - stats->mean);
+    int64_t abs_jitter = llabs(interval - expected);
+    if (abs_jitter > stats->max)
+        stats->max = abs_jitter;
+}
+
+void jitter_print(JitterStats *stats, FILE *fp) {
+    if (stats->count == 0)
+        return;
+    double stddev = stats->count > 1
+        ? sqrt(stats->m2 / (stats->count - 1)) : 0;
+    fprintf(fp, "presented %ld frames, jitter: "
+            "mean %.3f ms, stddev %.3f ms, max %.3f ms\n",
+            stats->count,
+            stats->mean / 1000,
+            stddev / 1000,
+            stats->max / 1000.0);
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// microseconds on the performance counter, which
+// (unlike SDL_GetTicks) is precise enough to time
+// frames at high refresh rates
+int64_t clock_now(void);
+
+// frame-to-frame presentation jitter, i.e. how much
+// the interval between two presents deviated from
+// the interval between their timestamps
+typedef struct {
+    bool    valid;      // whether last/last_pts may be used
+    int64_t last;       // present time of the previous frame
+    int64_t last_pts;   // pts of the previous frame
+    long    count;
+    double  mean, m2;   // running mean/variance (Welford)
+    int64_t max;
+} JitterStats;
+
+void jitter_break(JitterStats *stats);
+void jitter_update(JitterStats *stats, int64_t now, int64_t pts);
+void jitter_print(JitterStats *stats, FILE *fp);
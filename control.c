@@ -0,0 +1,477 @@
+#include <libavutil/avutil.h>
+#include <SDL2/SDL.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "app.h"
+#include "clock.h"
+#include "control.h"
+#include "macro.h"
+#include "player.h"
+
+// how often the control thread checks whether the player is
+// gone, while commands wait on the main thread
+#define CONTROL_WAIT_MS 100
+
+static void reply(ControlClient *client, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void reply(ControlClient *client, const char *fmt, ...) {
+    char buf[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof buf, fmt, ap);
+    va_end(ap);
+    len = min(len, (int)sizeof buf - 1);
+    // a client that went away gets dropped on its next read
+    for (int off = 0; off < len; ) {
+        ssize_t n = send(client->fd, buf + off, len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        off += n;
+    }
+}
+
+static void wake(Control *ctl) {
+    // the write end doesn't block, and a full pipe wakes the
+    // thread just the same
+    while (write(ctl->wake_fds[1], "", 1) < 0 && errno == EINTR)
+        ;
+}
+
+// with the lock held: leaves the answer to a client's command for
+// the control thread to send, or frees the slot if the client
+// went away in the meantime
+static void answer(Control *ctl, ControlClient *client, const char *text) {
+    if (client->fd < 0) {
+        client->state = CONTROL_IDLE;
+        return;
+    }
+    client->state = CONTROL_ANSWERED;
+    client->answer = text;
+    wake(ctl);
+}
+
+static inline double to_ms(int64_t us) {
+    return us == AV_NOPTS_VALUE ? -1.0 : us / 1000.0;
+}
+
+static inline double to_s(int64_t us) {
+    return us == AV_NOPTS_VALUE ? -1.0 : (double)us / AV_TIME_BASE;
+}
+
+// one line of key=value pairs; positions and latencies the
+// player doesn't know (yet) are -1
+static void reply_stats(Control *ctl, ControlClient *client,
+        const PlayerStats *stats) {
+    int64_t now = clock_now();
+    double fps = 0.0;
+    if (ctl->last_time != 0 && now > ctl->last_time)
+        fps = (double)(stats->frames_decoded - ctl->last_decoded) *
+            AV_TIME_BASE / (now - ctl->last_time);
+    ctl->last_time = now;
+    ctl->last_decoded = stats->frames_decoded;
+
+    reply(client, "ok position=%.3f duration=%.3f paused=%d done=%d "
+            "speed=%.2f video_queued=%d audio_queued=%d "
+            "frames_decoded=%lld frames_shown=%lld frames_dropped=%lld "
+            "av_offset_ms=%.1f decode_fps=%.1f seeks=%lld "
+            "seek_latency_ms=%.1f seek_latency_max_ms=%.1f "
+            "audio_underruns=%lld\n",
+            to_s(stats->position), to_s(stats->duration),
+            stats->paused, stats->done, stats->speed,
+            stats->video_queued, stats->audio_queued,
+            (long long)stats->frames_decoded,
+            (long long)stats->frames_shown,
+            (long long)stats->frames_dropped,
+            stats->av_offset == AV_NOPTS_VALUE
+                ? 0.0 : stats->av_offset / 1000.0,
+            fps, (long long)stats->seeks,
+            to_ms(stats->seek_latency), to_ms(stats->seek_latency_max),
+            (long long)stats->audio_underruns);
+}
+
+// parses a command line; "stats" and mistakes get answered right
+// away, and the rest handed to the main thread, which leaves an
+// "ok" or "error" and why once it has run them
+static void handle_line(Control *ctl, ControlClient *client, char *line) {
+    char op[16], arg[64], extra[16];
+    int n = sscanf(line, "%15s %63s %15s", op, arg, extra);
+    if (n <= 0)
+        return;
+
+    ControlCommand cmd = { 0 };
+    char *end;
+    if (strcmp(op, "stats") == 0 && n == 1) {
+        // only a snapshot, which any thread can take, so there's
+        // no need to wait on the main thread for it
+        ctl->commands++;
+        PlayerStats stats;
+        player_get_stats(ctl->player, &stats);
+        reply_stats(ctl, client, &stats);
+        return;
+    } else if (strcmp(op, "play") == 0 && n == 1) {
+        cmd.op = CONTROL_PLAY;
+    } else if (strcmp(op, "pause") == 0 && n == 1) {
+        cmd.op = CONTROL_PAUSE;
+    } else if (strcmp(op, "seek") == 0 && n >= 2) {
+        // "seek 90", "seek +10", "seek -10 exact"
+        cmd.op = CONTROL_SEEK;
+        cmd.value = strtod(arg, &end);
+        cmd.relative = arg[0] == '+' || arg[0] == '-';
+        cmd.exact = n == 3 && strcmp(extra, "exact") == 0;
+        if (end == arg || *end != '\0' || (n == 3 && !cmd.exact)) {
+            reply(client, "error usage: seek [+|-]SECONDS [exact]\n");
+            return;
+        }
+    } else if (strcmp(op, "volume") == 0 && n == 2) {
+        cmd.op = CONTROL_VOLUME;
+        cmd.value = strtod(arg, &end);
+        if (end == arg || *end != '\0' ||
+                !(cmd.value >= 0.0 && cmd.value <= 100.0)) {
+            reply(client, "error usage: volume PERCENT (0 to 100)\n");
+            return;
+        }
+    } else {
+        reply(client, "error unknown command: %s\n", line);
+        return;
+    }
+
+    // answered once the main thread has run it
+    ctl->commands++;
+    client->busy = true;
+    ASSERT(SDL_LockMutex(ctl->mutex) == 0);
+    client->cmd = cmd;
+    client->state = CONTROL_QUEUED;
+    ASSERT(SDL_UnlockMutex(ctl->mutex) == 0);
+    app_post_event(APP_EVENT_CONTROL);
+}
+
+// handles the lines a client sent, up to the first command that
+// has to wait for its answer
+static void handle_lines(Control *ctl, ControlClient *client) {
+    char *start = client->line;
+    char *nl;
+    while (!client->busy && (nl = strchr(start, '\n'))) {
+        *nl = '\0';
+        if (nl > start && nl[-1] == '\r')
+            nl[-1] = '\0';
+        handle_line(ctl, client, start);
+        start = nl + 1;
+    }
+    client->len -= start - client->line;
+    memmove(client->line, start, client->len + 1);
+}
+
+// reads what a client sent, and handles each line in it;
+// returns false once the client should be dropped
+static bool read_client(Control *ctl, ControlClient *client) {
+    ssize_t n = read(client->fd, client->line + client->len,
+            sizeof client->line - 1 - client->len);
+    if (n < 0 && errno == EINTR)
+        return true;
+    if (n <= 0)
+        return false;
+    client->len += n;
+    client->line[client->len] = '\0';
+
+    handle_lines(ctl, client);
+    if (client->len == (int)sizeof client->line - 1) {
+        reply(client, "error line too long\n");
+        return false;
+    }
+    return true;
+}
+
+static void accept_client(Control *ctl) {
+    int fd = accept(ctl->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        if (errno != EINTR && errno != EAGAIN)
+            LOG_ERROR("Error accepting control client: %s\n",
+                    strerror(errno));
+        return;
+    }
+    ASSERT(SDL_LockMutex(ctl->mutex) == 0);
+    ControlClient *client = NULL;
+    for (int i = 0; i < CONTROL_CLIENTS_MAX && !client; i++)
+        if (ctl->clients[i].fd < 0 &&
+                ctl->clients[i].state == CONTROL_IDLE)
+            client = &ctl->clients[i];
+    if (client)
+        *client = (ControlClient){ .fd = fd };
+    ASSERT(SDL_UnlockMutex(ctl->mutex) == 0);
+    if (!client) {
+        ControlClient full = { .fd = fd };
+        reply(&full, "error too many clients\n");
+        close(fd);
+        return;
+    }
+    ctl->connections++;
+}
+
+static void drop_client(Control *ctl, ControlClient *client) {
+    close(client->fd);
+    client->len = 0;
+    client->busy = false;
+    ASSERT(SDL_LockMutex(ctl->mutex) == 0);
+    client->fd = -1;
+    // one being run goes free once it's done
+    if (client->state != CONTROL_RUNNING)
+        client->state = CONTROL_IDLE;
+    ASSERT(SDL_UnlockMutex(ctl->mutex) == 0);
+}
+
+// sends the answers the main thread left, and goes on with what
+// those clients sent since; with the player gone, the commands
+// still waiting get an error instead
+static void send_answers(Control *ctl) {
+    const char *answers[CONTROL_CLIENTS_MAX] = { 0 };
+    bool done = player_done(ctl->player);
+    ASSERT(SDL_LockMutex(ctl->mutex) == 0);
+    for (int i = 0; i < CONTROL_CLIENTS_MAX; i++) {
+        ControlClient *client = &ctl->clients[i];
+        if (client->fd < 0)
+            continue;
+        if (client->state == CONTROL_ANSWERED)
+            answers[i] = client->answer;
+        else if (done && (client->state == CONTROL_QUEUED ||
+                    client->state == CONTROL_SEEKING))
+            answers[i] = "error player is done\n";
+        else
+            continue;
+        client->state = CONTROL_IDLE;
+    }
+    ASSERT(SDL_UnlockMutex(ctl->mutex) == 0);
+
+    for (int i = 0; i < CONTROL_CLIENTS_MAX; i++) {
+        ControlClient *client = &ctl->clients[i];
+        if (!answers[i])
+            continue;
+        reply(client, "%s", answers[i]);
+        client->busy = false;
+        handle_lines(ctl, client);
+    }
+}
+
+static int serve(void *ptr) {
+    Control *ctl = ptr;
+    while (true) {
+        struct pollfd fds[2 + CONTROL_CLIENTS_MAX];
+        fds[0] = (struct pollfd){ .fd = ctl->wake_fds[0], .events = POLLIN };
+        fds[1] = (struct pollfd){ .fd = ctl->listen_fd, .events = POLLIN };
+        // a client waiting for an answer isn't read from, but
+        // still gets dropped if it hangs up
+        bool waiting = false;
+        for (int i = 0; i < CONTROL_CLIENTS_MAX; i++) {
+            ControlClient *client = &ctl->clients[i];
+            fds[2 + i] = (struct pollfd){ .fd = client->fd,
+                .events = client->busy ? 0 : POLLIN };
+            waiting |= client->busy;
+        }
+        if (poll(fds, 2 + CONTROL_CLIENTS_MAX,
+                    waiting ? CONTROL_WAIT_MS : -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("Error polling control socket: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[0].revents) {
+            char buf[64];
+            (void)read(ctl->wake_fds[0], buf, sizeof buf);
+            ASSERT(SDL_LockMutex(ctl->mutex) == 0);
+            bool quit = ctl->quit;
+            ASSERT(SDL_UnlockMutex(ctl->mutex) == 0);
+            if (quit)
+                break;
+        }
+        send_answers(ctl);
+        for (int i = 0; i < CONTROL_CLIENTS_MAX; i++) {
+            ControlClient *client = &ctl->clients[i];
+            // poll() skips the free slots, with their fd of -1
+            if (!fds[2 + i].revents || client->fd < 0)
+                continue;
+            if (client->busy || !read_client(ctl, client))
+                drop_client(ctl, client);
+        }
+        if (fds[1].revents & POLLIN)
+            accept_client(ctl);
+    }
+    for (int i = 0; i < CONTROL_CLIENTS_MAX; i++)
+        if (ctl->clients[i].fd >= 0)
+            drop_client(ctl, &ctl->clients[i]);
+    return 0;
+}
+
+// whether nothing listens on the socket at addr any more
+static bool stale_socket(const struct sockaddr_un *addr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+    bool stale = connect(fd, (const struct sockaddr *)addr,
+            sizeof *addr) < 0 && errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+static bool listen_on(Control *ctl, const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof addr.sun_path) {
+        LOG_ERROR("Socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    // a socket left behind by a player that didn't get to clean
+    // up is in the way, but one a player still listens on isn't
+    // ours to take; anything else there is left alone
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (!stale_socket(&addr)) {
+            fprintf(stderr, "Error listening on '%s': "
+                    "something is listening on it\n", path);
+            return false;
+        }
+        (void)unlink(path);
+    }
+
+    ctl->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ctl->listen_fd < 0 ||
+            bind(ctl->listen_fd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+            listen(ctl->listen_fd, CONTROL_CLIENTS_MAX) < 0) {
+        fprintf(stderr, "Error listening on '%s': %s\n", path,
+                strerror(errno));
+        return false;
+    }
+    ctl->path = strdup(path);
+    return ctl->path != NULL;
+}
+
+static inline void control_closep(Control **pctl) {
+    if (*pctl)
+        control_close(*pctl);
+}
+
+Control *control_open(Player *p, const char *path) {
+    _cleanup_(control_closep) Control *ctl = calloc(1, sizeof *ctl);
+    if (!ctl) {
+        LOG_ERROR("Error allocating control socket\n");
+        return NULL;
+    }
+    ctl->player = p;
+    ctl->listen_fd = ctl->wake_fds[0] = ctl->wake_fds[1] = -1;
+    for (int i = 0; i < CONTROL_CLIENTS_MAX; i++)
+        ctl->clients[i].fd = -1;
+    ctl->mutex = SDL_CreateMutex();
+    if (!ctl->mutex) {
+        LOG_ERROR("Error initializing control socket\n");
+        return NULL;
+    }
+    if (pipe(ctl->wake_fds) < 0 ||
+            fcntl(ctl->wake_fds[1], F_SETFL, O_NONBLOCK) < 0) {
+        LOG_ERROR("Error creating pipe: %s\n", strerror(errno));
+        return NULL;
+    }
+    if (!listen_on(ctl, path))
+        return NULL;
+    ctl->thread = SDL_CreateThread(serve, "control_thread", ctl);
+    if (!ctl->thread) {
+        LOG_ERROR("Error launching control thread\n");
+        return NULL;
+    }
+    return TAKE_PTR(ctl);
+}
+
+void control_close(Control *ctl) {
+    if (ctl->thread) {
+        // poll() wakes up to the pipe
+        ASSERT(SDL_LockMutex(ctl->mutex) == 0);
+        ctl->quit = true;
+        ASSERT(SDL_UnlockMutex(ctl->mutex) == 0);
+        wake(ctl);
+        SDL_WaitThread(ctl->thread, NULL);
+    }
+    if (ctl->listen_fd >= 0)
+        close(ctl->listen_fd);
+    if (ctl->path) {
+        (void)unlink(ctl->path);
+        free(ctl->path);
+    }
+    for (int i = 0; i < 2; i++)
+        if (ctl->wake_fds[i] >= 0)
+            close(ctl->wake_fds[i]);
+    SDL_DestroyMutex(ctl->mutex);
+    free(ctl);
+}
+
+// runs a command, and returns its answer, or NULL for a seek,
+// which gets one once it has shown a frame
+static const char *run(Player *p, const ControlCommand *cmd) {
+    switch (cmd->op) {
+    case CONTROL_PLAY:
+        player_play(p);
+        break;
+    case CONTROL_PAUSE:
+        player_pause(p);
+        break;
+    case CONTROL_SEEK: {
+        if (!p->avparam.seekable)
+            return "error input is not seekable\n";
+        int64_t pts = (int64_t)(cmd->value * AV_TIME_BASE);
+        if (cmd->relative && p->app.frame_pts != AV_NOPTS_VALUE)
+            pts += p->app.frame_pts;
+        player_seek(p, max(pts, (int64_t)0), cmd->exact);
+        // present() tells us once it has shown a frame
+        return p->app.seek_time == AV_NOPTS_VALUE ? "ok\n" : NULL;
+    }
+    case CONTROL_VOLUME:
+        player_set_volume(p, cmd->value / 100.0);
+        break;
+    }
+    return "ok\n";
+}
+
+void control_run(Control *ctl) {
+    ASSERT(SDL_LockMutex(ctl->mutex) == 0);
+    for (int i = 0; i < CONTROL_CLIENTS_MAX; i++) {
+        ControlClient *client = &ctl->clients[i];
+        if (client->state != CONTROL_QUEUED)
+            continue;
+        client->state = CONTROL_RUNNING;
+        ControlCommand cmd = client->cmd;
+        // a seek waits on the fetch thread, so this can't hold
+        // the lock while running it
+        ASSERT(SDL_UnlockMutex(ctl->mutex) == 0);
+        const char *text = run(ctl->player, &cmd);
+        ASSERT(SDL_LockMutex(ctl->mutex) == 0);
+        if (text)
+            answer(ctl, client, text);
+        else
+            client->state = CONTROL_SEEKING;
+    }
+    ASSERT(SDL_UnlockMutex(ctl->mutex) == 0);
+}
+
+void control_seek_done(Control *ctl, bool eof) {
+    ASSERT(SDL_LockMutex(ctl->mutex) == 0);
+    for (int i = 0; i < CONTROL_CLIENTS_MAX; i++)
+        if (ctl->clients[i].state == CONTROL_SEEKING)
+            answer(ctl, &ctl->clients[i], eof ? "ok eof\n" : "ok\n");
+    ASSERT(SDL_UnlockMutex(ctl->mutex) == 0);
+}
+
+void control_print_stats(Control *ctl, FILE *fp) {
+    fprintf(fp, "control: %llu commands from %llu clients on %s\n",
+            (unsigned long long)ctl->commands,
+            (unsigned long long)ctl->connections, ctl->path);
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "player.h"
+
+#define CONTROL_CLIENTS_MAX 16
+#define CONTROL_LINE_MAX 256
+
+typedef enum {
+    CONTROL_PLAY,
+    CONTROL_PAUSE,
+    CONTROL_SEEK,
+    CONTROL_VOLUME,
+} ControlOp;
+
+// a command on its way to the main thread
+typedef struct {
+    ControlOp op;
+    double value;       // seconds to seek to or by, or volume in %
+    bool relative;
+    bool exact;
+} ControlCommand;
+
+// where a client's command is at; the client isn't read from
+// again until it's been answered
+typedef enum {
+    CONTROL_IDLE,
+    CONTROL_QUEUED,     // waiting for the main thread
+    CONTROL_RUNNING,    // being run on the main thread
+    CONTROL_SEEKING,    // a seek, waiting to show its first frame
+    CONTROL_ANSWERED,   // run, with an answer to send
+} ControlState;
+
+typedef struct {
+    int fd;             // -1 for a free slot
+    char line[CONTROL_LINE_MAX];
+    int len;
+    // waiting for the answer to a command; control thread only
+    bool busy;
+
+    // with the control's lock held
+    ControlState state;
+    ControlCommand cmd;
+    const char *answer;
+} ControlClient;
+
+// a local socket taking commands, one per line, from any number
+// of clients. The socket is serviced on a thread of its own,
+// which also answers "stats"; the other commands are run on the
+// main thread, which the control thread hands them to without
+// waiting, so one client's seek doesn't hold up the others
+struct Control {
+    Player *player;
+    char *path;
+    int listen_fd;
+    // written to once a command has been answered, and on
+    // shutdown, to wake the thread from poll()
+    int wake_fds[2];
+    SDL_Thread *thread;
+
+    SDL_mutex *mutex;
+    bool quit;
+
+    // a slot whose client went away while its command ran
+    // only comes free once that's done
+    ControlClient clients[CONTROL_CLIENTS_MAX];
+    // frames decoded at the last stats, and when, which the
+    // decode rate is taken over
+    int64_t last_time;
+    int64_t last_decoded;
+
+    uint64_t commands, connections;
+};
+
+// listens on path, replacing a stale socket there; returns NULL
+// on error
+Control *control_open(Player *p, const char *path);
+void control_close(Control *ctl);
+// runs the commands waiting, if there are any; main thread only
+void control_run(Control *ctl);
+// answers the seeks waiting for their first frame, which is on
+// screen, or never will be at eof; main thread only
+void control_seek_done(Control *ctl, bool eof);
+void control_print_stats(Control *ctl, FILE *fp);
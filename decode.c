@@ -6,58 +6,142 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include "app.h"
+#include "audio.h"
+#include "cache.h"
+#include "clock.h"
 #include "decode.h"
+#include "filter.h"
 #include "macro.h"
 #include "param.h"
+#include "player.h"
+#include "playlist.h"
 #include "queue.h"
 
 /* DONE: add av_strerror() strings to error messages */
 
-extern avparam_t avparam;
-extern Queue video_queue;
-extern Queue audio_queue;
+// playing at least this fast, the video decoder
+// skips non-reference frames
+#define SKIP_NONREF_SPEED 2.0
+
+// scrubbing shows keyframes as they come, so there's
+// no point decoding far ahead
+#define SCRUB_QUEUE_MAX 2
 
 static inline void unlockp(SDL_mutex **pmtx) {
     ASSERT(SDL_UnlockMutex(*pmtx) == 0);
 }
 
-static void seek() {
+void fetch_state_init(FetchState *fetch) {
+    fetch->codec_ctx = NULL;
+    fetch->stream_index = -1;
+    fetch->scrub_pts = AV_NOPTS_VALUE;
+    fetch->video_skip = fetch->audio_skip = AV_NOPTS_VALUE;
+    fetch->pass_end = AV_NOPTS_VALUE;
+    fetch->ab_replaying = false;
+    fetch->seek_empty = false;
+    fetch->video_decoded = 0;
+}
+
+static inline int64_t start_time(Player *p) {
+    return p->avparam.avctx->start_time == AV_NOPTS_VALUE
+        ? 0 : p->avparam.avctx->start_time;
+}
+
+// seeks to a time in the file, rather than on the timeline
+// pts_offset puts it on, and flushes the decoders
+static bool seek_file(Player *p, int64_t target, int flags) {
     // TODO: explicitly pass a stream index instead of -1
     // and adjust the seek pts accordingly
-    // NOTE: we hold the lock for avparam
-    int err = av_seek_frame(avparam.avctx, -1,
-            avparam.seek_pts * 1000,
-            avparam.seek_flags);
+    // with a stream index of -1, the timestamp is in
+    // AV_TIME_BASE units, same as seek_pts
+    int err = av_seek_frame(p->avparam.avctx, -1, target, flags);
     if (err < 0) {
         LOG_ERROR("Error seeking to frame: %s\n",
                 av_err2str(err));
-        return;
+        return false;
     }
     /* avformat_flush(thread_params.avctx); */
 
-    avcodec_flush_buffers(avparam.video_ctx);
-    avcodec_flush_buffers(avparam.audio_ctx);
-    if (avparam.sub_ctx)
-        avcodec_flush_buffers(avparam.sub_ctx);
+    avcodec_flush_buffers(p->avparam.video_ctx);
+    avcodec_flush_buffers(p->avparam.audio_ctx);
+    if (p->avparam.sub_ctx)
+        avcodec_flush_buffers(p->avparam.sub_ctx);
+    return true;
+}
 
-    // locking the video_queue isn't necessary, since the
-    // main thread, which uses it, is stalled waiting for
-    // the seek to finish
-    queue_flush(&video_queue);
+// drops what a filter stage has yet to get to; this has to come
+// before flushing the queue it feeds: the stage notes the
+// generation as it takes a frame, and drops any frame it took
+// from before this on its way to that queue
+static void flush_stage(FilterStage *stage) {
+    if (!filter_stage_enabled(stage))
+        return;
+    ASSERT(SDL_LockMutex(stage->in.mutex) == 0);
+    queue_flush(&stage->in);
+    SDL_AtomicIncRef(&stage->gen);
+    ASSERT(SDL_UnlockMutex(stage->in.mutex) == 0);
+}
 
+static void seek(Player *p) {
+    // NOTE: we hold the lock for avparam
+    // starting an A-B repeat goes to A, wherever a wrap since
+    // has put it on the timeline
+    if (p->avparam.ab_restart)
+        p->avparam.seek_pts = p->avparam.ab_a + p->avparam.pts_offset;
+    // a GOP decode must start before the frame it ends at,
+    // even if that one is a keyframe
+    int64_t target = p->avparam.seek_pts - p->avparam.pts_offset;
+    if (p->avparam.seek_mode == SEEK_GOP)
+        target--;
+    if (!seek_file(p, target, p->avparam.seek_flags))
+        return;
+
+    // the main thread is stalled waiting for the seek to
+    // finish, but a filter stage may still be feeding the
+    // video queue, so it gets flushed like the audio queue
+    flush_stage(&p->video_filter);
+    ASSERT(SDL_LockMutex(p->video_queue.mutex) == 0);
+    queue_flush(&p->video_queue);
+    ASSERT(SDL_UnlockMutex(p->video_queue.mutex) == 0);
+    p->fetch.scrub_pts = AV_NOPTS_VALUE;
+    p->fetch.seek_empty = true;
+    p->fetch.video_skip = p->fetch.audio_skip =
+        p->avparam.seek_mode == SEEK_EXACT
+        ? p->avparam.seek_pts : AV_NOPTS_VALUE;
+
+    // the head of the file has to be recorded in one go from
+    // the start, and an A-B segment from A
+    p->fetch.pass_end = target;
+    p->fetch.ab_replaying = false;
+    p->loop_head.recording = false;
+    if (p->ab_segment.recording)
+        segment_clear(&p->ab_segment);
+    if (p->avparam.ab_restart) {
+        segment_clear(&p->ab_segment);
+        p->ab_segment.recording = true;
+        p->avparam.ab_restart = false;
+    }
+
+    flush_stage(&p->audio_filter);
     // locking the audio queue IS necessary, since the
-    // audio callback, which uses it, runs asynchronously,
+    // audio thread, which uses it, runs asynchronously,
     // and might be trying to pop frames from it
-    ASSERT(SDL_LockMutex(audio_queue.mutex) == 0);
-    queue_flush(&audio_queue);
-    ASSERT(SDL_UnlockMutex(audio_queue.mutex) == 0);
+    ASSERT(SDL_LockMutex(p->audio_queue.mutex) == 0);
+    queue_flush(&p->audio_queue);
+    ASSERT(SDL_UnlockMutex(p->audio_queue.mutex) == 0);
+    // this has to come after flushing the queue: the audio
+    // thread notes the ring's generation as it pops a frame,
+    // so any frame it popped from before the seek gets dropped
+    audio_ring_flush(&p->audio_ring);
 }
 
-static void dump_subtitle(AVPacket *pkt) {
+static void dump_subtitle(Player *p, AVPacket *pkt) {
     AVSubtitle *sub = av_malloc(sizeof *sub);
     ASSERT(sub);
     int got_sub;
-    int err = avcodec_decode_subtitle2(avparam.sub_ctx,
+    int err = avcodec_decode_subtitle2(p->avparam.sub_ctx,
             sub, &got_sub, pkt);
     if (err < 0 || got_sub == 0) {
         av_freep(&sub);
@@ -82,8 +166,23 @@ static void dump_subtitle(AVPacket *pkt) {
     }
 }
 
-static int read_frame(AVCodecContext **pcodec_ctx, AVFrame *frame,
-        int *stream_index) {
+// moves a frame along the timeline by offset, in AV_TIME_BASE
+// units; only best_effort_timestamp, which is all the players
+// go by, so pts still says where the frame is in the file
+static void shift_frame(Player *p, AVFrame *frame, int stream_index,
+        int64_t offset) {
+    if (offset == 0 || frame->best_effort_timestamp == AV_NOPTS_VALUE)
+        return;
+    AVRational tb = p->avparam.avctx->streams[stream_index]->time_base;
+    frame->best_effort_timestamp +=
+        av_rescale_q(offset, AV_TIME_BASE_Q, tb);
+}
+
+// reads the next frame from either decoder, noting which one
+// in the fetch state
+static int read_frame(Player *p, AVFrame *frame) {
+    AVCodecContext **pcodec_ctx = &p->fetch.codec_ctx;
+    int *stream_index = &p->fetch.stream_index;
     int err;
 
     err = avcodec_receive_frame(*pcodec_ctx, frame);
@@ -95,7 +194,7 @@ static int read_frame(AVCodecContext **pcodec_ctx, AVFrame *frame,
         }
 
         do {
-            err = av_read_frame(avparam.avctx, pkt);
+            err = av_read_frame(p->avparam.avctx, pkt);
             if (err == AVERROR_EOF) {
                 return err;
             } else if (err < 0) {
@@ -104,14 +203,14 @@ static int read_frame(AVCodecContext **pcodec_ctx, AVFrame *frame,
                 return err;
             }
             *pcodec_ctx =
-                pkt->stream_index == avparam.video_si
-                ? avparam.video_ctx
-                : pkt->stream_index == avparam.audio_si
-                ? avparam.audio_ctx
+                pkt->stream_index == p->avparam.video_si
+                ? p->avparam.video_ctx
+                : pkt->stream_index == p->avparam.audio_si
+                ? p->avparam.audio_ctx
                 : NULL;
             *stream_index = pkt->stream_index;
-            if (pkt->stream_index == avparam.sub_si) {
-                dump_subtitle(pkt);
+            if (pkt->stream_index == p->avparam.sub_si) {
+                dump_subtitle(p, pkt);
             }
         } while (!*pcodec_ctx);
 
@@ -130,77 +229,715 @@ static int read_frame(AVCodecContext **pcodec_ctx, AVFrame *frame,
         return err;
     }
 
+    // the other threads go by this, as the streams it came from
+    // may be gone by the time they get to it
+    frame->time_base = p->avparam.avctx->streams[*stream_index]->time_base;
+    if (*stream_index == p->avparam.video_si) {
+        ASSERT(SDL_LockMutex(p->stats_mutex) == 0);
+        p->stats.frames_decoded = ++p->fetch.video_decoded;
+        ASSERT(SDL_UnlockMutex(p->stats_mutex) == 0);
+    }
+    shift_frame(p, frame, *stream_index, p->avparam.pts_offset);
     return 0;
 }
 
-static int put_frame(Queue *queue, AVFrame *frame) {
+// blocks while the queue is full; a filter stage passes the
+// generation it took the frame at, and the frame gets dropped
+// if a seek came in since
+static void enqueue(Player *p, Queue *queue, AVFrame *frame,
+        FilterStage *stage, int gen) {
     _cleanup_(unlockp) SDL_mutex *queue_mtx = queue->mutex;
     ASSERT(SDL_LockMutex(queue_mtx) == 0);
 
-    while (queue->count == QUEUE_MAX) {
+    int limit = p->avparam.scrub ? SCRUB_QUEUE_MAX : QUEUE_MAX;
+    while (queue->count >= limit) {
+        // fetch_wake() signals us when a seek or quit is requested
+        if (p->avparam.do_seek || p->avparam.done) {
+            av_frame_free(&frame);
+            return;
+        }
+        ASSERT(SDL_CondWait(queue->empty, queue_mtx) == 0);
+    }
+    if (stage && SDL_AtomicGet(&stage->gen) != gen) {
+        av_frame_free(&frame);
+        return;
+    }
+    queue_enqueue(queue, frame);
+    ASSERT(SDL_CondSignal(queue->fill) == 0);
+
+    // the main loop sleeps while there is nothing to show,
+    // so wake it when the first frame arrives
+    if (queue == &p->video_queue && queue->count == 1)
+        app_post_event(APP_EVENT_FRAME);
+}
+
+// where frames for a queue go first: the filter stage in
+// front of it, if there is one
+static inline Queue *stage_queue(Player *p, Queue *queue) {
+    FilterStage *stage = queue == &p->video_queue
+        ? &p->video_filter : &p->audio_filter;
+    return filter_stage_enabled(stage) ? &stage->in : queue;
+}
+
+static int put_frame(Player *p, Queue *queue, AVFrame *frame) {
+    enqueue(p, stage_queue(p, queue), frame, NULL, 0);
+    return 0;
+}
+
+// at EOF, tells the filter stages nothing more is coming, with a
+// NULL frame, so they hand over what the filters held back
+static void end_stages(Player *p) {
+    FilterStage *stages[] = { &p->video_filter, &p->audio_filter };
+    for (int i = 0; i < 2; i++)
+        if (filter_stage_enabled(stages[i]))
+            enqueue(p, &stages[i]->in, NULL, NULL, 0);
+}
+
+// tells the main thread the last seek landed past the last
+// frame, unless another one is on its way
+static void report_seek_eof(Player *p) {
+    p->fetch.seek_empty = false;
+    ASSERT(SDL_LockMutex(p->avparam.seek_mtx) == 0);
+    p->avparam.seek_eof = !p->avparam.do_seek;
+    ASSERT(SDL_UnlockMutex(p->avparam.seek_mtx) == 0);
+    app_post_event(APP_EVENT_EOF);
+}
+
+// at EOF, loop mode being turned on also ends the wait
+static void wait_seek(Player *p, bool eof) {
+    ASSERT(SDL_LockMutex(p->avparam.seek_mtx) == 0);
+    while (!p->avparam.do_seek && !p->avparam.done &&
+            !(eof && p->avparam.loop))
+        ASSERT(SDL_CondWait(p->avparam.seek_req, p->avparam.seek_mtx) == 0);
+    ASSERT(SDL_UnlockMutex(p->avparam.seek_mtx) == 0);
+}
+
+static int64_t stream_time(Player *p, AVFrame *frame, int stream_index) {
+    if (frame->best_effort_timestamp == AV_NOPTS_VALUE)
+        return AV_NOPTS_VALUE;
+    AVRational tb = p->avparam.avctx->streams[stream_index]->time_base;
+    return av_rescale_q(frame->best_effort_timestamp,
+            tb, AV_TIME_BASE_Q);
+}
+
+static inline int64_t video_time(Player *p, AVFrame *frame) {
+    return stream_time(p, frame, p->avparam.video_si);
+}
+
+// video frames are taken as a point in time
+static int64_t frame_end(Player *p, AVFrame *frame, int stream_index,
+        int64_t pts) {
+    if (stream_index == p->avparam.video_si)
+        return pts;
+    return pts + (int64_t)frame->nb_samples * AV_TIME_BASE /
+        frame->sample_rate;
+}
+
+// after an exact seek, whether a frame still comes before
+// the target and should be dropped
+static bool seek_skip(Player *p, AVFrame *frame, int stream_index) {
+    bool video = stream_index == p->avparam.video_si;
+    int64_t *skip = video ? &p->fetch.video_skip : &p->fetch.audio_skip;
+    if (*skip == AV_NOPTS_VALUE)
+        return false;
+    int64_t pts = stream_time(p, frame, stream_index);
+    if (pts == AV_NOPTS_VALUE)
+        return false;
+    // audio frames are long enough that one reaching
+    // past the target is better kept
+    int64_t end = frame_end(p, frame, stream_index, pts);
+    if (end < *skip)
+        return true;
+    *skip = AV_NOPTS_VALUE;
+    return false;
+}
+
+// keeps a copy of a frame, at its time in the file, while
+// a segment is recording
+static void record(Player *p, Segment *seg, AVFrame *frame,
+        int stream_index) {
+    if (!seg->recording)
+        return;
+    int64_t pts = stream_time(p, frame, stream_index);
+    AVFrame *copy = av_frame_clone(frame);
+    if (pts == AV_NOPTS_VALUE || !copy) {
+        av_frame_free(&copy);
+        seg->recording = false;
+        return;
+    }
+    shift_frame(p, copy, stream_index, -p->avparam.pts_offset);
+    pts -= p->avparam.pts_offset;
+    (void)segment_add(seg, copy, stream_index,
+            stream_index == p->avparam.video_si,
+            pts, frame_end(p, frame, stream_index, pts));
+}
+
+// notes a frame on its way to the queue: how far this pass
+// got, and whatever is recording
+static void note_frame(Player *p, AVFrame *frame, int stream_index) {
+    int64_t pts = stream_time(p, frame, stream_index);
+    if (pts != AV_NOPTS_VALUE) {
+        int64_t end = frame_end(p, frame, stream_index, pts) -
+            p->avparam.pts_offset;
+        if (p->fetch.pass_end == AV_NOPTS_VALUE || end > p->fetch.pass_end)
+            p->fetch.pass_end = end;
+    }
+    record(p, &p->loop_head, frame, stream_index);
+    record(p, &p->ab_segment, frame, stream_index);
+}
+
+AVFrame *decode_first_frame(Player *p) {
+    if (!p->fetch.codec_ctx) {
+        p->fetch.codec_ctx = p->avparam.video_ctx;
+        p->fetch.stream_index = p->avparam.video_si;
+    }
+
+    for (;;) {
+        // we can't block on a full queue here, as nobody is
+        // draining it yet; leave the rest to the fetch thread
+        Queue *audio_queue = stage_queue(p, &p->audio_queue);
+        ASSERT(SDL_LockMutex(audio_queue->mutex) == 0);
+        bool full = audio_queue->count == QUEUE_MAX;
+        ASSERT(SDL_UnlockMutex(audio_queue->mutex) == 0);
+        if (full)
+            return NULL;
+
+        _cleanup_(av_frame_free) AVFrame *frame = av_frame_alloc();
+        if (!frame) {
+            LOG_ERROR("Error allocating frame\n");
+            return NULL;
+        }
+        if (read_frame(p, frame) < 0)
+            return NULL;
+        note_frame(p, frame, p->fetch.stream_index);
+        if (p->fetch.stream_index != p->avparam.video_si) {
+            (void)put_frame(p, &p->audio_queue, TAKE_PTR(frame));
+            continue;
+        }
+        if (!p->avparam.startup.first_decoded)
+            p->avparam.startup.first_decoded = clock_now();
+        if (!filter_stage_enabled(&p->video_filter))
+            return TAKE_PTR(frame);
+        // the stage's thread isn't running yet, so the first
+        // frame can go through the filters here; anything else
+        // they put out is left for the thread to pick up
+        FilterChain *chain = &p->video_filter.chain;
+        if (!filter_chain_send(chain, TAKE_PTR(frame)))
+            return NULL;
+        AVFrame *out = filter_chain_receive(chain);
+        if (out)
+            return out;
+    }
+}
+
+// only keyframes get decoded when scrubbing, and no audio there
+// or while stepping frames; at high speeds, frames nothing refers
+// to get skipped, as most frames get dropped anyway
+static void update_discard(Player *p) {
+    p->avparam.video_ctx->skip_frame =
+        p->avparam.scrub ? AVDISCARD_NONKEY
+        : p->avparam.speed >= SKIP_NONREF_SPEED ? AVDISCARD_NONREF
+        : AVDISCARD_DEFAULT;
+    p->avparam.avctx->streams[p->avparam.audio_si]->discard =
+        p->avparam.scrub || p->avparam.stepping
+        ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+}
+
+// moves what comes out of the step cache's filters into it, so
+// stepping back shows frames filtered like the ones played
+static void cache_filtered(Player *p, int64_t end) {
+    AVFrame *out;
+    while ((out = filter_chain_receive(&p->step_filter))) {
+        int64_t pts = out->best_effort_timestamp == AV_NOPTS_VALUE
+            ? AV_NOPTS_VALUE : av_rescale_q(out->best_effort_timestamp,
+                    out->time_base, AV_TIME_BASE_Q);
+        if (pts == AV_NOPTS_VALUE || pts > end)
+            av_frame_free(&out);
+        else
+            frame_cache_add(&p->step_cache, out, pts, end);
+    }
+}
+
+// decodes from the keyframe a seek landed on up to end, into
+// the step cache; the first frame past end goes to the queue,
+// and the fetch loop carries on from there
+static void decode_gop(Player *p, int64_t end) {
+    update_discard(p);
+    for (;;) {
+        _cleanup_(av_frame_free) AVFrame *frame = av_frame_alloc();
+        if (!frame) {
+            LOG_ERROR("Error allocating frame\n");
+            break;
+        }
+        if (read_frame(p, frame) < 0)
+            break;
+        if (p->fetch.stream_index != p->avparam.video_si)
+            continue;
+        int64_t pts = video_time(p, frame);
+        if (pts == AV_NOPTS_VALUE)
+            continue;
+        if (pts > end) {
+            (void)put_frame(p, &p->video_queue, TAKE_PTR(frame));
+            break;
+        }
+        if (p->step_filter.count == 0)
+            frame_cache_add(&p->step_cache, TAKE_PTR(frame), pts, end);
+        else if (filter_chain_send(&p->step_filter, TAKE_PTR(frame)))
+            cache_filtered(p, end);
+    }
+    // what the filters still hold is the end of the GOP, and
+    // the next one starts them over
+    if (filter_chain_flush(&p->step_filter))
+        cache_filtered(p, end);
+    filter_chain_reset(&p->step_filter);
+}
+
+// steps back to the keyframe before the last one queued, which
+// takes a seek per keyframe; returns false at the start of the
+// file, or on error
+static bool scrub_back(Player *p) {
+    int64_t start = start_time(p);
+    int64_t target = p->fetch.scrub_pts - 1 - p->avparam.pts_offset;
+    for (int64_t step = AV_TIME_BASE; target >= start; step *= 2) {
+        if (!seek_file(p, target, AVSEEK_FLAG_BACKWARD))
+            return false;
+
+        _cleanup_(av_frame_free) AVFrame *frame = av_frame_alloc();
+        if (!frame) {
+            LOG_ERROR("Error allocating frame\n");
+            return false;
+        }
         int err;
         do {
-            err = SDL_CondWaitTimeout(queue->empty,
-                    queue_mtx, DEFAULT_FRAME_DELAY);
-            ASSERT(err >= 0);
+            av_frame_unref(frame);
+            err = read_frame(p, frame);
+        } while (err == 0 && p->fetch.stream_index != p->avparam.video_si);
+        if (err < 0)
+            return false;
 
-            if (avparam.do_seek) {
-                av_frame_free(&frame);
-                return 0;
-            }
-            if (avparam.done) {
-                av_frame_free(&frame);
-                return 0;
-            }
-        } while (err == SDL_MUTEX_TIMEDOUT);
+        int64_t pts = video_time(p, frame);
+        if (pts == AV_NOPTS_VALUE || pts < p->fetch.scrub_pts) {
+            p->fetch.scrub_pts = pts == AV_NOPTS_VALUE
+                ? target + p->avparam.pts_offset : pts;
+            (void)put_frame(p, &p->video_queue, TAKE_PTR(frame));
+            return true;
+        }
+        // a coarse index can land us on the same keyframe
+        // again, so look further back each time
+        target -= step;
     }
-    queue_enqueue(queue, frame);
-    ASSERT(SDL_CondSignal(queue->fill) == 0);
+    return false;
+}
+
+// queues a segment's frames again, moved along to where the
+// timeline has got to; returns false if a seek or quit cut it
+// short
+static bool replay(Player *p, Segment *seg) {
+    for (int i = 0; i < seg->count; i++) {
+        if (p->avparam.do_seek || p->avparam.done)
+            return false;
+        AVFrame *frame = av_frame_clone(seg->frames[i].frame);
+        if (!frame) {
+            LOG_ERROR("Error allocating frame\n");
+            return false;
+        }
+        int si = seg->frames[i].stream_index;
+        shift_frame(p, frame, si, p->avparam.pts_offset);
+        (void)put_frame(p, si == p->avparam.video_si
+                ? &p->video_queue : &p->audio_queue, frame);
+    }
+    seg->replays++;
+    return true;
+}
+
+// goes back to start, playing what the segment has of it from
+// memory, and decoding the rest from where that ends; returns
+// true if it all came from memory, leaving the demuxer where
+// it was
+static bool replay_from(Player *p, Segment *seg, int64_t start) {
+    if (seg->count > 0 && seg->video_end != AV_NOPTS_VALUE &&
+            seg->audio_end != AV_NOPTS_VALUE) {
+        if (!replay(p, seg))
+            return false;
+        p->fetch.pass_end = max(seg->video_end, seg->audio_end);
+        if (seg->complete)
+            return true;
+        if (seek_file(p, seg->video_end, AVSEEK_FLAG_BACKWARD)) {
+            p->fetch.video_skip = seg->video_end + 1 + p->avparam.pts_offset;
+            p->fetch.audio_skip = seg->audio_end + 1 + p->avparam.pts_offset;
+        }
+        return false;
+    }
+
+    // nothing usable, so decode it all, and record it this time
+    p->fetch.pass_end = start;
+    if (seek_file(p, start, AVSEEK_FLAG_BACKWARD)) {
+        p->fetch.video_skip = p->fetch.audio_skip =
+            start + p->avparam.pts_offset;
+        segment_clear(seg);
+        seg->recording = true;
+    }
+    return false;
+}
+
+// keeps a decoded frame of the head being filled, at its time
+// in the file; returns false once the segment is full
+static bool fill_add(HeadFill *fill, AVFrame *frame, int stream_index) {
+    AVStream *st = fill->param.avctx->streams[stream_index];
+    frame->time_base = st->time_base;
+    if (frame->best_effort_timestamp == AV_NOPTS_VALUE) {
+        av_frame_free(&frame);
+        return true;
+    }
+    int64_t pts = av_rescale_q(frame->best_effort_timestamp,
+            st->time_base, AV_TIME_BASE_Q);
+    bool video = stream_index == fill->param.video_si;
+    int64_t end = video ? pts : pts +
+        (int64_t)frame->nb_samples * AV_TIME_BASE / frame->sample_rate;
+    return segment_add(&fill->seg, frame, stream_index, video, pts, end);
+}
 
+// takes what a decoder has for the head; returns false once
+// that's full, or on error
+static bool fill_drain(HeadFill *fill, AVCodecContext *ctx,
+        int stream_index) {
+    while (true) {
+        AVFrame *frame = av_frame_alloc();
+        if (!frame)
+            return false;
+        int err = avcodec_receive_frame(ctx, frame);
+        if (err < 0) {
+            av_frame_free(&frame);
+            return err == AVERROR(EAGAIN) || err == AVERROR_EOF;
+        }
+        if (!fill_add(fill, frame, stream_index))
+            return false;
+    }
+}
+
+// decodes from the start of the file until the segment fills
+// up, or the file ends, which makes it complete
+static void fill_decode(Player *p, HeadFill *fill) {
+    avparam_t *param = &fill->param;
+    fill->seg.recording = true;
+    _cleanup_(av_packet_free) AVPacket *pkt = av_packet_alloc();
+    while (pkt && fill->seg.recording && !fill->quit && !p->avparam.done) {
+        int err = av_read_frame(param->avctx, pkt);
+        if (err == AVERROR_EOF) {
+            // what the decoders still hold is the end of the file
+            (void)avcodec_send_packet(param->video_ctx, NULL);
+            (void)avcodec_send_packet(param->audio_ctx, NULL);
+            if (fill_drain(fill, param->video_ctx, param->video_si) &&
+                    fill_drain(fill, param->audio_ctx, param->audio_si) &&
+                    fill->seg.recording)
+                fill->seg.complete = true;
+            break;
+        }
+        if (err < 0)
+            break;
+        int si = pkt->stream_index;
+        AVCodecContext *ctx = si == param->video_si ? param->video_ctx
+            : si == param->audio_si ? param->audio_ctx : NULL;
+        if (ctx && (avcodec_send_packet(ctx, pkt) < 0 ||
+                    !fill_drain(fill, ctx, si)))
+            break;
+        av_packet_unref(pkt);
+    }
+    fill->seg.recording = false;
+}
+
+static int fill_head(void *ptr) {
+    Player *p = ptr;
+    HeadFill *fill = &p->head_fill;
+    if (avparam_open(&fill->param, fill->url, &p->opts))
+        fill_decode(p, fill);
+    avparam_close(&fill->param);
+    SDL_AtomicSet(&fill->finished, 1);
     return 0;
 }
 
-int fetch_frames(void *ptr) {
-    int stream_index = avparam.video_si;
-    AVCodecContext *codec_ctx = avparam.video_ctx;
+// once loop mode is on, starts filling the head of the file in
+// the background, unless this pass is recording it already
+static void head_fill_start(Player *p) {
+    HeadFill *fill = &p->head_fill;
+    if (fill->started || !p->avparam.seekable || p->playlist.count > 1 ||
+            p->loop_head.count > 0 || p->loop_head.recording)
+        return;
+    fill->started = true;
+    fill->quit = false;
+    fill->url = p->playlist.urls[p->playlist.current];
+    SDL_AtomicSet(&fill->finished, 0);
+    if (!segment_init(&fill->seg, p->opts.repeat_cache))
+        return;
+    fill->thread = SDL_CreateThread(fill_head, "head_fill", p);
+    if (!fill->thread)
+        LOG_ERROR("Error launching head fill thread\n");
+}
+
+void head_fill_stop(Player *p) {
+    HeadFill *fill = &p->head_fill;
+    if (fill->thread) {
+        fill->quit = true;
+        SDL_WaitThread(fill->thread, NULL);
+        fill->thread = NULL;
+    }
+    segment_fini(&fill->seg);
+    fill->started = false;
+}
+
+// at EOF, makes the head filled in the background the one
+// loop_wrap() goes by, if it's ready; if not, this wrap records
+// it the usual way instead
+static void head_fill_take(Player *p) {
+    HeadFill *fill = &p->head_fill;
+    if (!fill->thread)
+        return;
+    if (SDL_AtomicGet(&fill->finished) && fill->seg.count > 0) {
+        SDL_WaitThread(fill->thread, NULL);
+        fill->thread = NULL;
+        segment_fini(&p->loop_head);
+        p->loop_head = fill->seg;
+        // the segment is the loop head's now
+        memset(&fill->seg, 0, sizeof fill->seg);
+        return;
+    }
+    head_fill_stop(p);
+    // it stays tried for this item
+    fill->started = true;
+}
+
+// starts over from the top at EOF, with timestamps carrying
+// on from where this pass ended
+static void loop_wrap(Player *p) {
+    if (p->loop_head.recording) {
+        p->loop_head.recording = false;
+        p->loop_head.complete = true;
+    }
+    head_fill_take(p);
+    int64_t start = start_time(p);
+    if (p->fetch.pass_end != AV_NOPTS_VALUE)
+        p->avparam.pts_offset += p->fetch.pass_end - start;
+    (void)replay_from(p, &p->loop_head, start);
+}
+
+// goes from end, which is B unless the file ran out first,
+// back to A, with timestamps carrying on from end
+static void ab_wrap(Player *p, int64_t end) {
+    if (p->ab_segment.recording) {
+        p->ab_segment.recording = false;
+        p->ab_segment.complete = true;
+    }
+    if (end == AV_NOPTS_VALUE)
+        end = p->avparam.ab_b;
+    p->avparam.pts_offset += end - p->avparam.ab_a;
+    p->fetch.ab_replaying = replay_from(p, &p->ab_segment, p->avparam.ab_a);
+}
+
+// moves on to the next playlist item, which has been opening in
+// the background, with timestamps carrying on from where this
+// one ended; to the queues, it's all one stream
+static bool next_item(Player *p) {
+    int64_t end = p->fetch.pass_end == AV_NOPTS_VALUE
+        ? AV_NOPTS_VALUE : p->fetch.pass_end + p->avparam.pts_offset;
+    if (!playlist_advance(&p->playlist, &p->avparam, p->avparam.loop))
+        return false;
+    player_publish_item(p);
+
+    p->fetch.codec_ctx = p->avparam.video_ctx;
+    p->fetch.stream_index = p->avparam.video_si;
+    if (end != AV_NOPTS_VALUE)
+        p->avparam.pts_offset = end - start_time(p);
+    p->fetch.pass_end = start_time(p);
+    p->fetch.scrub_pts = AV_NOPTS_VALUE;
+    p->fetch.video_skip = p->fetch.audio_skip = AV_NOPTS_VALUE;
+    // what was recorded is of the item before
+    head_fill_stop(p);
+    segment_clear(&p->loop_head);
+    segment_clear(&p->ab_segment);
+    p->fetch.ab_replaying = false;
+    p->avparam.ab_a = AV_NOPTS_VALUE;
+    return true;
+}
+
+// whether a frame is at or past B, in A-B repeat
+static bool ab_reached(Player *p, AVFrame *frame, int stream_index) {
+    int64_t pts = stream_time(p, frame, stream_index);
+    return pts != AV_NOPTS_VALUE &&
+        pts - p->avparam.pts_offset >= p->avparam.ab_b;
+}
+
+static int fetch_loop(Player *p) {
     int err;
 
-    (void)ptr;
+    if (!p->fetch.codec_ctx) {
+        p->fetch.codec_ctx = p->avparam.video_ctx;
+        p->fetch.stream_index = p->avparam.video_si;
+    }
 
     for (;;) {
-        if (avparam.done)
+        if (p->avparam.done)
             return 0;
 
-        ASSERT(SDL_LockMutex(avparam.seek_mtx) == 0);
-        if (avparam.do_seek) {
-            seek();
-            avparam.do_seek = false;
-            ASSERT(SDL_CondSignal(avparam.seek_done) == 0);
+        ASSERT(SDL_LockMutex(p->avparam.seek_mtx) == 0);
+        if (p->avparam.do_seek) {
+            seek(p);
+            if (p->avparam.seek_mode == SEEK_GOP)
+                decode_gop(p, p->avparam.seek_pts);
+            p->avparam.do_seek = false;
+            ASSERT(SDL_CondSignal(p->avparam.seek_done) == 0);
+        }
+        ASSERT(SDL_UnlockMutex(p->avparam.seek_mtx) == 0);
+
+        update_discard(p);
+        if (p->avparam.loop)
+            head_fill_start(p);
+
+        if (p->avparam.scrub && p->avparam.scrub_dir < 0 &&
+                p->fetch.scrub_pts != AV_NOPTS_VALUE) {
+            if (!scrub_back(p))
+                wait_seek(p, false);
+            continue;
+        }
+
+        // scrubbing and stepping go where they're told, not round
+        // in circles
+        bool repeat = !p->avparam.scrub && !p->avparam.stepping;
+        if (!p->avparam.ab_active) {
+            p->fetch.ab_replaying = false;
+            if (p->ab_segment.count > 0)
+                segment_clear(&p->ab_segment);
+        }
+        if (repeat && p->avparam.ab_active && p->fetch.ab_replaying) {
+            ab_wrap(p, p->avparam.ab_b);
+            continue;
         }
-        ASSERT(SDL_UnlockMutex(avparam.seek_mtx) == 0);
 
         _cleanup_(av_frame_free) AVFrame *frame = av_frame_alloc();
         if (!frame) {
             LOG_ERROR("Error allocating frame\n");
-            avparam.done = true;
             return AVERROR(ENOMEM);
         }
 
-        err = read_frame(&codec_ctx, frame, &stream_index);
+        err = read_frame(p, frame);
         if (err == AVERROR_EOF) {
-            // wait a bit so we don't spin too fast at EOF
-            SDL_Delay(DEFAULT_FRAME_DELAY);
+            if (repeat && p->avparam.ab_active) {
+                ab_wrap(p, p->fetch.pass_end);
+            } else if (repeat && next_item(p)) {
+                continue;
+            } else if (repeat && p->avparam.loop) {
+                loop_wrap(p);
+            } else {
+                // nothing left to do until the user seeks or quits
+                end_stages(p);
+                if (p->fetch.seek_empty)
+                    report_seek_eof(p);
+                wait_seek(p, true);
+            }
             continue;
         }
         else if (err < 0) {
-            avparam.done = true;
             return err;
         }
 
-        Queue *queue = stream_index == avparam.video_si
-            ? &video_queue : &audio_queue;
-        (void)put_frame(queue, TAKE_PTR(frame));
+        if (seek_skip(p, frame, p->fetch.stream_index))
+            continue;
+        if (repeat && p->avparam.ab_active &&
+                ab_reached(p, frame, p->fetch.stream_index)) {
+            // audio past B just gets dropped; video means we're there
+            if (p->fetch.stream_index == p->avparam.video_si)
+                ab_wrap(p, p->avparam.ab_b);
+            continue;
+        }
+        note_frame(p, frame, p->fetch.stream_index);
+        if (p->fetch.stream_index == p->avparam.video_si) {
+            p->fetch.scrub_pts = video_time(p, frame);
+            p->fetch.seek_empty = false;
+        }
+        Queue *queue = p->fetch.stream_index == p->avparam.video_si
+            ? &p->video_queue : &p->audio_queue;
+        (void)put_frame(p, queue, TAKE_PTR(frame));
     }
 
     /* return 0; */
 }
+
+int fetch_frames(void *ptr) {
+    Player *p = ptr;
+
+    int err = fetch_loop(p);
+
+    // the main thread may be waiting on a seek, or sleeping
+    // in its event loop, so tell it we're gone
+    ASSERT(SDL_LockMutex(p->avparam.seek_mtx) == 0);
+    p->avparam.done = true;
+    ASSERT(SDL_CondBroadcast(p->avparam.seek_done) == 0);
+    ASSERT(SDL_UnlockMutex(p->avparam.seek_mtx) == 0);
+    app_post_event(APP_EVENT_DONE);
+
+    return err;
+}
+
+// runs a filter stage: takes frames from its input queue, and
+// puts what comes out of the filters on the queue it feeds
+int filter_frames(void *ptr) {
+    FilterStage *stage = ptr;
+    Player *p = stage->player;
+    int chain_gen = SDL_AtomicGet(&stage->gen);
+    while (true) {
+        ASSERT(SDL_LockMutex(stage->in.mutex) == 0);
+        while (stage->in.count == 0 && !p->avparam.done)
+            ASSERT(SDL_CondWait(stage->in.fill, stage->in.mutex) == 0);
+        if (p->avparam.done) {
+            ASSERT(SDL_UnlockMutex(stage->in.mutex) == 0);
+            break;
+        }
+        AVFrame *frame = queue_dequeue(&stage->in);
+        ASSERT(SDL_CondSignal(stage->in.empty) == 0);
+        // see flush_stage() for why this is read with
+        // the queue locked
+        int gen = SDL_AtomicGet(&stage->gen);
+        ASSERT(SDL_UnlockMutex(stage->in.mutex) == 0);
+
+        // what the filters hold on to is stale after a seek
+        if (gen != chain_gen) {
+            filter_chain_reset(&stage->chain);
+            chain_gen = gen;
+        }
+        // a filter that fails once fails for good, so give up
+        // and let the fetch thread tell the main thread; NULL
+        // is the end of the input, see end_stages()
+        bool eof = !frame;
+        if (!(eof ? filter_chain_flush(&stage->chain)
+                    : filter_chain_send(&stage->chain, frame))) {
+            p->avparam.done = true;
+            fetch_wake(p);
+            break;
+        }
+        AVFrame *out;
+        while ((out = filter_chain_receive(&stage->chain)))
+            enqueue(p, stage->out, out, stage, gen);
+        // a seek or loop starts the filters over
+        if (eof)
+            filter_chain_reset(&stage->chain);
+    }
+    return 0;
+}
+
+void fetch_wake(Player *p) {
+    // wakes the fetch thread from wherever it's blocked, so it
+    // can notice a pending seek or quit, and the filter stages
+    Queue *queues[] = {
+        &p->video_queue, &p->audio_queue,
+        &p->video_filter.in, &p->audio_filter.in,
+    };
+    for (int i = 0; i < 4; i++) {
+        if (!queues[i]->mutex)
+            continue;
+        ASSERT(SDL_LockMutex(queues[i]->mutex) == 0);
+        ASSERT(SDL_CondSignal(queues[i]->empty) == 0);
+        ASSERT(SDL_UnlockMutex(queues[i]->mutex) == 0);
+    }
+    ASSERT(SDL_LockMutex(p->avparam.seek_mtx) == 0);
+    ASSERT(SDL_CondSignal(p->avparam.seek_req) == 0);
+    ASSERT(SDL_UnlockMutex(p->avparam.seek_mtx) == 0);
+}
@@ -1,3 +1,57 @@
 #pragma once
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "cache.h"
+#include "param.h"
 
+typedef struct AVCodecContext AVCodecContext;
+typedef struct AVFrame AVFrame;
+typedef struct Player Player;
+
+// what the fetch thread keeps track of between frames
+typedef struct {
+    // the decoder read_frame() last returned a frame from, which
+    // it drains before reading more packets; this carries over
+    // from decode_first_frame() to the fetch thread
+    AVCodecContext *codec_ctx;
+    int stream_index;
+    // in scrub mode, the pts of the last keyframe queued, which
+    // stepping backward goes on from
+    int64_t scrub_pts;
+    // after an exact seek, frames of each stream that end
+    // before these get dropped
+    int64_t video_skip;
+    int64_t audio_skip;
+    // the file time this pass through the file got up to, from
+    // which the next loop or repeat carries on
+    int64_t pass_end;
+    // set once the whole A-B segment is in memory and playing
+    // from there, leaving the demuxer past B
+    bool ab_replaying;
+    // no video frame has been queued since the last seek
+    bool seek_empty;
+    // video frames out of the decoder, for the decode rate
+    uint64_t video_decoded;
+} FetchState;
+
+// the start of the file, decoded on a thread of its own with a
+// second demuxer and decoders, for when loop mode gets turned on
+// after the first pass has gone by it
+typedef struct {
+    avparam_t param;
+    Segment seg;
+    const char *url;
+    SDL_Thread *thread;
+    SDL_atomic_t finished;
+    bool quit;
+    // tried once per item
+    bool started;
+} HeadFill;
+
+void fetch_state_init(FetchState *fetch);
+AVFrame *decode_first_frame(Player *p);
 int fetch_frames(void *ptr);
+int filter_frames(void *ptr);
+void fetch_wake(Player *p);
+void head_fill_stop(Player *p);
@@ -0,0 +1,263 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "dsp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DSP_X86
+#endif
+
+static inline float clampf(float v, float lo, float hi) {
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+static void gain_f32_c(float *buf, int n, float g0, float step) {
+    for (int i = 0; i < n; i++)
+        buf[i] = clampf(buf[i] * (g0 + step * i), -1.0f, 1.0f);
+}
+
+static void gain_s16_c(int16_t *buf, int n, float g0, float step) {
+    for (int i = 0; i < n; i++)
+        buf[i] = lrintf(clampf(buf[i] * (g0 + step * i),
+                    -32768.0f, 32767.0f));
+}
+
+static void downmix_f32_c(float *out, const float *const *in, int nb_in,
+        int n, const float *coef_l, const float *coef_r) {
+    for (int i = 0; i < n; i++) {
+        float l = 0, r = 0;
+        for (int c = 0; c < nb_in; c++) {
+            l += coef_l[c] * in[c][i];
+            r += coef_r[c] * in[c][i];
+        }
+        out[2 * i] = clampf(l, -1.0f, 1.0f);
+        out[2 * i + 1] = clampf(r, -1.0f, 1.0f);
+    }
+}
+
+#ifdef DSP_X86
+__attribute__((target("sse2")))
+static void gain_f32_sse2(float *buf, int n, float g0, float step) {
+    __m128 g = _mm_add_ps(_mm_set1_ps(g0),
+            _mm_mul_ps(_mm_set1_ps(step), _mm_setr_ps(0, 1, 2, 3)));
+    __m128 inc = _mm_set1_ps(4 * step);
+    __m128 lo = _mm_set1_ps(-1.0f);
+    __m128 hi = _mm_set1_ps(1.0f);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_mul_ps(_mm_loadu_ps(buf + i), g);
+        _mm_storeu_ps(buf + i, _mm_min_ps(_mm_max_ps(v, lo), hi));
+        g = _mm_add_ps(g, inc);
+    }
+    gain_f32_c(buf + i, n - i, g0 + step * i, step);
+}
+
+__attribute__((target("sse2")))
+static void gain_s16_sse2(int16_t *buf, int n, float g0, float step) {
+    __m128 g = _mm_add_ps(_mm_set1_ps(g0),
+            _mm_mul_ps(_mm_set1_ps(step), _mm_setr_ps(0, 1, 2, 3)));
+    __m128 inc4 = _mm_set1_ps(4 * step);
+    __m128 inc8 = _mm_set1_ps(8 * step);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(buf + i));
+        // sign extend to 32 bits by unpacking into the high
+        // half and shifting back down
+        __m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        __m128i b = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        __m128 fa = _mm_mul_ps(_mm_cvtepi32_ps(a), g);
+        __m128 fb = _mm_mul_ps(_mm_cvtepi32_ps(b), _mm_add_ps(g, inc4));
+        // packing saturates, which takes care of clipping
+        __m128i out = _mm_packs_epi32(_mm_cvtps_epi32(fa),
+                _mm_cvtps_epi32(fb));
+        _mm_storeu_si128((__m128i *)(buf + i), out);
+        g = _mm_add_ps(g, inc8);
+    }
+    gain_s16_c(buf + i, n - i, g0 + step * i, step);
+}
+
+__attribute__((target("sse2")))
+static void downmix_f32_sse2(float *out, const float *const *in, int nb_in,
+        int n, const float *coef_l, const float *coef_r) {
+    __m128 lo = _mm_set1_ps(-1.0f);
+    __m128 hi = _mm_set1_ps(1.0f);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 l = _mm_setzero_ps();
+        __m128 r = _mm_setzero_ps();
+        for (int c = 0; c < nb_in; c++) {
+            __m128 v = _mm_loadu_ps(in[c] + i);
+            l = _mm_add_ps(l, _mm_mul_ps(_mm_set1_ps(coef_l[c]), v));
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(coef_r[c]), v));
+        }
+        l = _mm_min_ps(_mm_max_ps(l, lo), hi);
+        r = _mm_min_ps(_mm_max_ps(r, lo), hi);
+        _mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(l, r));
+        _mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(l, r));
+    }
+    if (i < n) {
+        const float *tail[nb_in];
+        for (int c = 0; c < nb_in; c++)
+            tail[c] = in[c] + i;
+        downmix_f32_c(out + 2 * i, tail, nb_in, n - i, coef_l, coef_r);
+    }
+}
+
+__attribute__((target("avx2")))
+static void gain_f32_avx2(float *buf, int n, float g0, float step) {
+    __m256 g = _mm256_add_ps(_mm256_set1_ps(g0),
+            _mm256_mul_ps(_mm256_set1_ps(step),
+                _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)));
+    __m256 inc = _mm256_set1_ps(8 * step);
+    __m256 lo = _mm256_set1_ps(-1.0f);
+    __m256 hi = _mm256_set1_ps(1.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_mul_ps(_mm256_loadu_ps(buf + i), g);
+        _mm256_storeu_ps(buf + i, _mm256_min_ps(_mm256_max_ps(v, lo), hi));
+        g = _mm256_add_ps(g, inc);
+    }
+    gain_f32_c(buf + i, n - i, g0 + step * i, step);
+}
+
+__attribute__((target("avx2")))
+static void gain_s16_avx2(int16_t *buf, int n, float g0, float step) {
+    __m256 g = _mm256_add_ps(_mm256_set1_ps(g0),
+            _mm256_mul_ps(_mm256_set1_ps(step),
+                _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)));
+    __m256 inc8 = _mm256_set1_ps(8 * step);
+    __m256 inc16 = _mm256_set1_ps(16 * step);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i a = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(s));
+        __m256i b = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(s, 1));
+        __m256 fa = _mm256_mul_ps(_mm256_cvtepi32_ps(a), g);
+        __m256 fb = _mm256_mul_ps(_mm256_cvtepi32_ps(b),
+                _mm256_add_ps(g, inc8));
+        // packing saturates, but works within 128-bit lanes,
+        // so the middle quarters need swapping afterwards
+        __m256i out = _mm256_packs_epi32(_mm256_cvtps_epi32(fa),
+                _mm256_cvtps_epi32(fb));
+        out = _mm256_permute4x64_epi64(out, 0xd8);
+        _mm256_storeu_si256((__m256i *)(buf + i), out);
+        g = _mm256_add_ps(g, inc16);
+    }
+    gain_s16_c(buf + i, n - i, g0 + step * i, step);
+}
+
+__attribute__((target("avx2")))
+static void downmix_f32_avx2(float *out, const float *const *in, int nb_in,
+        int n, const float *coef_l, const float *coef_r) {
+    __m256 lo = _mm256_set1_ps(-1.0f);
+    __m256 hi = _mm256_set1_ps(1.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 l = _mm256_setzero_ps();
+        __m256 r = _mm256_setzero_ps();
+        for (int c = 0; c < nb_in; c++) {
+            __m256 v = _mm256_loadu_ps(in[c] + i);
+            l = _mm256_add_ps(l, _mm256_mul_ps(_mm256_set1_ps(coef_l[c]), v));
+            r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_set1_ps(coef_r[c]), v));
+        }
+        l = _mm256_min_ps(_mm256_max_ps(l, lo), hi);
+        r = _mm256_min_ps(_mm256_max_ps(r, lo), hi);
+        // unpacking works within 128-bit lanes too, so
+        // put the halves back in order
+        __m256 a = _mm256_unpacklo_ps(l, r);
+        __m256 b = _mm256_unpackhi_ps(l, r);
+        _mm256_storeu_ps(out + 2 * i, _mm256_permute2f128_ps(a, b, 0x20));
+        _mm256_storeu_ps(out + 2 * i + 8, _mm256_permute2f128_ps(a, b, 0x31));
+    }
+    if (i < n) {
+        const float *tail[nb_in];
+        for (int c = 0; c < nb_in; c++)
+            tail[c] = in[c] + i;
+        downmix_f32_c(out + 2 * i, tail, nb_in, n - i, coef_l, coef_r);
+    }
+}
+#endif
+
+static void (*gain_f32)(float *, int, float, float) = gain_f32_c;
+static void (*gain_s16)(int16_t *, int, float, float) = gain_s16_c;
+static void (*downmix_f32)(float *, const float *const *, int, int,
+        const float *, const float *) = downmix_f32_c;
+
+DspLevel dsp_best_level(void) {
+#ifdef DSP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return DSP_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return DSP_SSE2;
+#endif
+    return DSP_SCALAR;
+}
+
+bool dsp_set_level(DspLevel level) {
+    if (level > dsp_best_level())
+        return false;
+    switch (level) {
+    case DSP_SCALAR:
+        gain_f32 = gain_f32_c;
+        gain_s16 = gain_s16_c;
+        downmix_f32 = downmix_f32_c;
+        break;
+#ifdef DSP_X86
+    case DSP_SSE2:
+        gain_f32 = gain_f32_sse2;
+        gain_s16 = gain_s16_sse2;
+        downmix_f32 = downmix_f32_sse2;
+        break;
+    case DSP_AVX2:
+        gain_f32 = gain_f32_avx2;
+        gain_s16 = gain_s16_avx2;
+        downmix_f32 = downmix_f32_avx2;
+        break;
+#endif
+    default:
+        return false;
+    }
+    return true;
+}
+
+const char *dsp_level_name(DspLevel level) {
+    switch (level) {
+    case DSP_SCALAR: return "scalar";
+    case DSP_SSE2:   return "sse2";
+    case DSP_AVX2:   return "avx2";
+    }
+    return "unknown";
+}
+
+void dsp_gain_f32(float *buf, int n, float g0, float g1) {
+    if (n > 0)
+        gain_f32(buf, n, g0, (g1 - g0) / n);
+}
+
+void dsp_gain_s16(int16_t *buf, int n, float g0, float g1) {
+    if (n > 0)
+        gain_s16(buf, n, g0, (g1 - g0) / n);
+}
+
+void dsp_downmix_f32(float *out, const float *const *in, int nb_in,
+        int n, const float *coef_l, const float *coef_r) {
+    downmix_f32(out, in, nb_in, n, coef_l, coef_r);
+}
+
+void dsp_gain_s32(int32_t *buf, int n, float g0, float g1) {
+    double step = n > 0 ? (double)(g1 - g0) / n : 0;
+    for (int i = 0; i < n; i++) {
+        double v = buf[i] * (g0 + step * i);
+        buf[i] = v > INT32_MAX ? INT32_MAX : v < INT32_MIN ? INT32_MIN
+            : lrint(v);
+    }
+}
+
+void dsp_gain_u8(uint8_t *buf, int n, float g0, float g1) {
+    float step = n > 0 ? (g1 - g0) / n : 0;
+    for (int i = 0; i < n; i++)
+        buf[i] = 128 + lrintf(clampf((buf[i] - 128) * (g0 + step * i),
+                    -128.0f, 127.0f));
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// audio kernels, with vectorized versions picked at runtime
+// by what the CPU supports
+
+typedef enum {
+    DSP_SCALAR,
+    DSP_SSE2,
+    DSP_AVX2,
+} DspLevel;
+
+DspLevel dsp_best_level(void);
+bool dsp_set_level(DspLevel level);
+const char *dsp_level_name(DspLevel level);
+
+// multiply n samples by a gain ramping linearly from g0 to g1
+// (which must not exceed 1), clipping to full scale
+void dsp_gain_f32(float *buf, int n, float g0, float g1);
+void dsp_gain_s16(int16_t *buf, int n, float g0, float g1);
+// the rarer device formats only get scalar versions
+void dsp_gain_s32(int32_t *buf, int n, float g0, float g1);
+void dsp_gain_u8(uint8_t *buf, int n, float g0, float g1);
+
+// mix nb_in planar channels of n samples down to interleaved
+// stereo, with a left and right coefficient per input channel
+void dsp_downmix_f32(float *out, const float *const *in, int nb_in,
+        int n, const float *coef_l, const float *coef_r);
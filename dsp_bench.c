@@ -0,0 +1,114 @@
+// times the audio kernels at each level the CPU supports,
+// and checks them against the scalar versions
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dsp.h"
+
+#define NB_SAMPLES 1024
+#define NB_CHANNELS 6
+#define ITERATIONS 20000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static float in_f32[NB_CHANNELS][NB_SAMPLES];
+static int16_t in_s16[NB_SAMPLES * 2];
+static float buf_f32[NB_SAMPLES * 2];
+static int16_t buf_s16[NB_SAMPLES * 2];
+static float ref_f32[NB_SAMPLES * 2];
+static int16_t ref_s16[NB_SAMPLES * 2];
+static float mix_out[NB_SAMPLES * 2];
+static float mix_ref[NB_SAMPLES * 2];
+
+static const float coef_l[NB_CHANNELS] = { 0.41, 0, 0.29, 0, 0.29, 0 };
+static const float coef_r[NB_CHANNELS] = { 0, 0.41, 0.29, 0, 0, 0.29 };
+
+static void run_gain_f32(void) {
+    memcpy(buf_f32, in_f32, sizeof buf_f32);
+    dsp_gain_f32(buf_f32, NB_SAMPLES * 2, 1.0f, 0.5f);
+}
+
+static void run_gain_s16(void) {
+    memcpy(buf_s16, in_s16, sizeof buf_s16);
+    dsp_gain_s16(buf_s16, NB_SAMPLES * 2, 1.0f, 0.5f);
+}
+
+static void run_downmix(void) {
+    const float *planes[NB_CHANNELS];
+    for (int c = 0; c < NB_CHANNELS; c++)
+        planes[c] = in_f32[c];
+    dsp_downmix_f32(mix_out, planes, NB_CHANNELS, NB_SAMPLES,
+            coef_l, coef_r);
+}
+
+// returns ns per sample
+static double bench(void (*run)(void), int nb_samples) {
+    for (int i = 0; i < ITERATIONS / 10; i++)
+        run();
+    double start = now();
+    for (int i = 0; i < ITERATIONS; i++)
+        run();
+    return (now() - start) * 1e9 / ITERATIONS / nb_samples;
+}
+
+static double max_diff_f32(const float *a, const float *b, int n) {
+    double diff = 0;
+    for (int i = 0; i < n; i++)
+        diff = fmax(diff, fabs(a[i] - b[i]));
+    return diff;
+}
+
+static int max_diff_s16(const int16_t *a, const int16_t *b, int n) {
+    int diff = 0;
+    for (int i = 0; i < n; i++)
+        diff = abs(a[i] - b[i]) > diff ? abs(a[i] - b[i]) : diff;
+    return diff;
+}
+
+int main(void) {
+    srand(1);
+    // a bit over full scale, so clipping gets exercised
+    for (int c = 0; c < NB_CHANNELS; c++)
+        for (int i = 0; i < NB_SAMPLES; i++)
+            in_f32[c][i] = 2.2f * rand() / RAND_MAX - 1.1f;
+    for (int i = 0; i < NB_SAMPLES * 2; i++)
+        in_s16[i] = rand() % 65536 - 32768;
+
+    (void)dsp_set_level(DSP_SCALAR);
+    run_gain_f32();
+    run_gain_s16();
+    run_downmix();
+    memcpy(ref_f32, buf_f32, sizeof ref_f32);
+    memcpy(ref_s16, buf_s16, sizeof ref_s16);
+    memcpy(mix_ref, mix_out, sizeof mix_ref);
+
+    double base[3] = {};
+    printf("%-8s %18s %18s %18s\n", "level",
+            "gain f32 ns/smp", "gain s16 ns/smp", "downmix ns/smp");
+    for (DspLevel level = DSP_SCALAR; level <= dsp_best_level(); level++) {
+        if (!dsp_set_level(level))
+            continue;
+        double t[3] = {
+            bench(run_gain_f32, NB_SAMPLES * 2),
+            bench(run_gain_s16, NB_SAMPLES * 2),
+            bench(run_downmix, NB_SAMPLES),
+        };
+        if (level == DSP_SCALAR)
+            memcpy(base, t, sizeof base);
+        printf("%-8s %10.3f (%4.1fx) %10.3f (%4.1fx) %10.3f (%4.1fx)\n",
+                dsp_level_name(level),
+                t[0], base[0] / t[0], t[1], base[1] / t[1],
+                t[2], base[2] / t[2]);
+        printf("%-8s max error vs. scalar: %g, %d, %g\n", "",
+                max_diff_f32(buf_f32, ref_f32, NB_SAMPLES * 2),
+                max_diff_s16(buf_s16, ref_s16, NB_SAMPLES * 2),
+                max_diff_f32(mix_out, mix_ref, NB_SAMPLES * 2));
+    }
+    return 0;
+}
@@ -0,0 +1,341 @@
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/avutil.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "clock.h"
+#include "filter.h"
+#include "macro.h"
+
+static bool add_segment(FilterChain *chain, const char *desc, size_t len) {
+    if (len == 0) {
+        LOG_ERROR("Empty filter in the filter description\n");
+        return false;
+    }
+    char *copy = av_strndup(desc, len);
+    if (!copy) {
+        LOG_ERROR("Error allocating filter description\n");
+        return false;
+    }
+    chain->segments[chain->count++].desc = copy;
+    return true;
+}
+
+static void free_segments(FilterChain *chain) {
+    for (int i = 0; i < chain->count; i++)
+        av_freep(&chain->segments[i].desc);
+    chain->count = 0;
+}
+
+// splits a description into its filters, at the commas that
+// aren't quoted or escaped; one with labels or several chains
+// can't be split like that, and stays in one piece
+static bool split(FilterChain *chain, const char *desc) {
+    if (!strpbrk(desc, ";[")) {
+        const char *start = desc;
+        bool quoted = false;
+        for (const char *s = desc; chain->count < FILTER_SEGMENTS_MAX; s++) {
+            if (*s == '\\' && s[1]) {
+                s++;
+            } else if (*s == '\'') {
+                quoted = !quoted;
+            } else if (!*s || (*s == ',' && !quoted)) {
+                if (!add_segment(chain, start, s - start))
+                    return false;
+                if (!*s)
+                    return true;
+                start = s + 1;
+            }
+        }
+        // too many to time one by one; they run fine together
+        free_segments(chain);
+    }
+    return add_segment(chain, desc, strlen(desc));
+}
+
+bool filter_chain_init(FilterChain *chain, const char *desc,
+        enum AVMediaType type) {
+    memset(chain, 0, sizeof *chain);
+    chain->type = type;
+    if (!desc)
+        return true;
+    if (!split(chain, desc)) {
+        free_segments(chain);
+        return false;
+    }
+    return true;
+}
+
+void filter_chain_reset(FilterChain *chain) {
+    for (int i = 0; i < chain->count; i++) {
+        avfilter_graph_free(&chain->segments[i].graph);
+        chain->segments[i].src = chain->segments[i].sink = NULL;
+    }
+    av_channel_layout_uninit(&chain->ch_layout);
+    chain->configured = false;
+}
+
+void filter_chain_fini(FilterChain *chain) {
+    filter_chain_reset(chain);
+    free_segments(chain);
+}
+
+// the buffer source arguments for a segment: the first takes
+// frames like the one given, the others what the one before
+// puts out
+static void src_args(FilterChain *chain, int k, const AVFrame *frame,
+        char *args, size_t size) {
+    AVFilterContext *prev = k > 0 ? chain->segments[k - 1].sink : NULL;
+    AVRational tb = prev ? av_buffersink_get_time_base(prev)
+        : frame->time_base;
+    if (chain->type == AVMEDIA_TYPE_VIDEO) {
+        AVRational sar = prev ? av_buffersink_get_sample_aspect_ratio(prev)
+            : frame->sample_aspect_ratio;
+        snprintf(args, size,
+                "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:"
+                "pixel_aspect=%d/%d",
+                prev ? av_buffersink_get_w(prev) : frame->width,
+                prev ? av_buffersink_get_h(prev) : frame->height,
+                prev ? av_buffersink_get_format(prev) : frame->format,
+                tb.num, tb.den, sar.num, max(sar.den, 1));
+        return;
+    }
+    AVChannelLayout layout = { 0 };
+    char layout_name[64] = "";
+    if (prev)
+        (void)av_buffersink_get_ch_layout(prev, &layout);
+    (void)av_channel_layout_describe(prev ? &layout : &frame->ch_layout,
+            layout_name, sizeof layout_name);
+    av_channel_layout_uninit(&layout);
+    snprintf(args, size,
+            "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=%s",
+            tb.num, tb.den,
+            prev ? av_buffersink_get_sample_rate(prev) : frame->sample_rate,
+            av_get_sample_fmt_name(prev ? av_buffersink_get_format(prev)
+                : frame->format),
+            layout_name);
+}
+
+static inline void inout_freep(AVFilterInOut **pinout) {
+    avfilter_inout_free(pinout);
+}
+
+static bool segment_config(FilterChain *chain, FilterSegment *seg,
+        const char *args) {
+    bool video = chain->type == AVMEDIA_TYPE_VIDEO;
+    seg->graph = avfilter_graph_alloc();
+    if (!seg->graph) {
+        LOG_ERROR("Error allocating filter graph\n");
+        return false;
+    }
+    // filters that can work on slices of a frame split it
+    // between a thread per core
+    seg->graph->thread_type = AVFILTER_THREAD_SLICE;
+    seg->graph->nb_threads = 0;
+    if (avfilter_graph_create_filter(&seg->src,
+                avfilter_get_by_name(video ? "buffer" : "abuffer"),
+                "in", args, NULL, seg->graph) < 0 ||
+            avfilter_graph_create_filter(&seg->sink,
+                avfilter_get_by_name(video ? "buffersink" : "abuffersink"),
+                "out", NULL, NULL, seg->graph) < 0) {
+        LOG_ERROR("Error creating buffer filters\n");
+        return false;
+    }
+
+    _cleanup_(inout_freep) AVFilterInOut *outputs = avfilter_inout_alloc();
+    _cleanup_(inout_freep) AVFilterInOut *inputs = avfilter_inout_alloc();
+    if (!outputs || !inputs) {
+        LOG_ERROR("Error allocating filter graph\n");
+        return false;
+    }
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = seg->src;
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = seg->sink;
+    int err = avfilter_graph_parse_ptr(seg->graph, seg->desc,
+            &inputs, &outputs, NULL);
+    if (err >= 0)
+        err = avfilter_graph_config(seg->graph, NULL);
+    if (err < 0) {
+        LOG_ERROR("Error setting up filter '%s': %s\n",
+                seg->desc, av_err2str(err));
+        return false;
+    }
+    return true;
+}
+
+static bool configure(FilterChain *chain, const AVFrame *frame) {
+    for (int i = 0; i < chain->count; i++) {
+        char args[256];
+        src_args(chain, i, frame, args, sizeof args);
+        if (!segment_config(chain, &chain->segments[i], args)) {
+            filter_chain_reset(chain);
+            return false;
+        }
+    }
+    chain->time_base = frame->time_base;
+    chain->width = frame->width;
+    chain->height = frame->height;
+    chain->format = frame->format;
+    chain->sample_aspect = frame->sample_aspect_ratio;
+    chain->sample_rate = frame->sample_rate;
+    if (chain->type == AVMEDIA_TYPE_AUDIO &&
+            av_channel_layout_copy(&chain->ch_layout, &frame->ch_layout) < 0) {
+        filter_chain_reset(chain);
+        return false;
+    }
+    chain->configured = true;
+    chain->configs++;
+    return true;
+}
+
+// whether the graphs are set up for frames like this one
+static bool same_input(FilterChain *chain, const AVFrame *frame) {
+    if (av_cmp_q(chain->time_base, frame->time_base) != 0 ||
+            chain->format != frame->format)
+        return false;
+    if (chain->type == AVMEDIA_TYPE_VIDEO)
+        return chain->width == frame->width &&
+            chain->height == frame->height &&
+            av_cmp_q(chain->sample_aspect, frame->sample_aspect_ratio) == 0;
+    return chain->sample_rate == frame->sample_rate &&
+        av_channel_layout_compare(&chain->ch_layout, &frame->ch_layout) == 0;
+}
+
+// takes the next frame out of segment k, if it has one
+static AVFrame *pull(FilterChain *chain, int k) {
+    FilterSegment *seg = &chain->segments[k];
+    _cleanup_(av_frame_free) AVFrame *out = av_frame_alloc();
+    if (!out) {
+        LOG_ERROR("Error allocating frame\n");
+        return NULL;
+    }
+    int64_t start = clock_now();
+    int err = av_buffersink_get_frame(seg->sink, out);
+    seg->time += clock_now() - start;
+    if (err < 0) {
+        if (err != AVERROR(EAGAIN) && err != AVERROR_EOF)
+            LOG_ERROR("Error reading from filter '%s': %s\n",
+                    seg->desc, av_err2str(err));
+        return NULL;
+    }
+    seg->frames_out++;
+    return TAKE_PTR(out);
+}
+
+// feeds a frame to segment k, and whatever comes out of that
+// on to the next, up to the last, which filter_chain_receive()
+// drains; most of the work happens while pulling frames out
+static bool push(FilterChain *chain, int k, AVFrame *frame) {
+    _cleanup_(av_frame_free) AVFrame *in = frame;
+    FilterSegment *seg = &chain->segments[k];
+    int64_t start = clock_now();
+    int err = av_buffersrc_add_frame(seg->src, in);
+    seg->time += clock_now() - start;
+    if (err < 0) {
+        LOG_ERROR("Error feeding filter '%s': %s\n",
+                seg->desc, av_err2str(err));
+        return false;
+    }
+    seg->frames_in++;
+    if (k == chain->count - 1)
+        return true;
+    AVFrame *out;
+    while ((out = pull(chain, k)))
+        if (!push(chain, k + 1, out))
+            return false;
+    return true;
+}
+
+// ends segment k's input, passing what that flushes out of it
+// on to the next, and then ending that one's too
+static bool push_eof(FilterChain *chain, int k) {
+    FilterSegment *seg = &chain->segments[k];
+    int64_t start = clock_now();
+    int err = av_buffersrc_add_frame(seg->src, NULL);
+    seg->time += clock_now() - start;
+    if (err < 0) {
+        LOG_ERROR("Error flushing filter '%s': %s\n",
+                seg->desc, av_err2str(err));
+        return false;
+    }
+    if (k == chain->count - 1)
+        return true;
+    AVFrame *out;
+    while ((out = pull(chain, k)))
+        if (!push(chain, k + 1, out))
+            return false;
+    return push_eof(chain, k + 1);
+}
+
+// feeds a frame to the chain, which takes ownership of it; the
+// graphs get set up again if the frame doesn't look like the
+// ones before, dropping what they still held
+bool filter_chain_send(FilterChain *chain, AVFrame *frame) {
+    _cleanup_(av_frame_free) AVFrame *in = frame;
+    if (chain->configured && !same_input(chain, in))
+        filter_chain_reset(chain);
+    if (!chain->configured && !configure(chain, in))
+        return false;
+
+    // the filters go by the timeline, which (unlike the file
+    // time in pts) doesn't go back at a loop or a new item
+    if (in->best_effort_timestamp != AV_NOPTS_VALUE) {
+        if (in->pts != AV_NOPTS_VALUE)
+            chain->offset = av_rescale_q(
+                    in->best_effort_timestamp - in->pts,
+                    in->time_base, AV_TIME_BASE_Q);
+        in->pts = in->best_effort_timestamp;
+    }
+    return push(chain, 0, TAKE_PTR(in));
+}
+
+// returns the next filtered frame, if any, with its timestamps
+// and time base set like the fetch thread sets them
+AVFrame *filter_chain_receive(FilterChain *chain) {
+    if (!chain->configured)
+        return NULL;
+    FilterSegment *last = &chain->segments[chain->count - 1];
+    AVFrame *out = pull(chain, chain->count - 1);
+    if (!out)
+        return NULL;
+    out->time_base = av_buffersink_get_time_base(last->sink);
+    out->best_effort_timestamp = out->pts;
+    if (out->pts != AV_NOPTS_VALUE)
+        out->pts -= av_rescale_q(chain->offset, AV_TIME_BASE_Q,
+                out->time_base);
+    return out;
+}
+
+bool filter_chain_flush(FilterChain *chain) {
+    if (!chain->configured)
+        return true;
+    return push_eof(chain, 0);
+}
+
+void filter_chain_print_stats(FilterChain *chain, const char *name,
+        FILE *fp) {
+    if (chain->count == 0)
+        return;
+    int64_t total = 0;
+    for (int i = 0; i < chain->count; i++)
+        total += chain->segments[i].time;
+    fprintf(fp, "%s: %d filters, set up %llu times, %.1f ms in all\n",
+            name, chain->count, (unsigned long long)chain->configs,
+            total / 1000.0);
+    for (int i = 0; i < chain->count; i++) {
+        FilterSegment *seg = &chain->segments[i];
+        fprintf(fp, "%s: %s: %llu frames in, %llu out, "
+                "%.3f ms per frame, %.1f%% of the chain\n",
+                name, seg->desc,
+                (unsigned long long)seg->frames_in,
+                (unsigned long long)seg->frames_out,
+                seg->frames_in ? seg->time / 1000.0 / seg->frames_in : 0.0,
+                total ? 100.0 * seg->time / total : 0.0);
+    }
+}
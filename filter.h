@@ -0,0 +1,78 @@
+#pragma once
+#include <libavfilter/avfilter.h>
+#include <libavutil/frame.h>
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "queue.h"
+
+#define FILTER_SEGMENTS_MAX 16
+
+typedef struct Player Player;
+
+// one link of a chain: a filter (or, for descriptions that
+// aren't a plain chain, all of them) in a graph of its own,
+// so what it costs can be told apart from the rest
+typedef struct {
+    char *desc;
+    AVFilterGraph *graph;
+    AVFilterContext *src, *sink;
+    int64_t time;       // spent feeding and draining it, in us
+    uint64_t frames_in, frames_out;
+} FilterSegment;
+
+// the user's --vf or --af, set up lazily for whatever the
+// frames coming in look like
+typedef struct {
+    enum AVMediaType type;
+    FilterSegment segments[FILTER_SEGMENTS_MAX];
+    int count;
+
+    // what the graphs are set up for; a change in any of it
+    // sets them up again
+    bool configured;
+    AVRational time_base;
+    int width, height, format;
+    AVRational sample_aspect;
+    int sample_rate;
+    AVChannelLayout ch_layout;
+
+    // how far the frame last sent in was moved along the
+    // timeline, in AV_TIME_BASE units, which the frames coming
+    // out get moved by too
+    int64_t offset;
+    uint64_t configs;
+} FilterChain;
+
+// a chain on a thread of its own, between the fetch thread and
+// one of the player's queues, which it keeps fed like the fetch
+// thread would
+typedef struct {
+    FilterChain chain;
+    Player *player;
+    Queue in;
+    Queue *out;
+    // bumped by a seek, once it has flushed the input queue;
+    // frames taken from before that don't make it to the output
+    SDL_atomic_t gen;
+    SDL_Thread *thread;
+} FilterStage;
+
+bool filter_chain_init(FilterChain *chain, const char *desc,
+        enum AVMediaType type);
+void filter_chain_fini(FilterChain *chain);
+// drops the graphs, and whatever they held on to
+void filter_chain_reset(FilterChain *chain);
+bool filter_chain_send(FilterChain *chain, AVFrame *frame);
+AVFrame *filter_chain_receive(FilterChain *chain);
+// tells the filters there's nothing more to come, so whatever
+// they hold on to comes out of filter_chain_receive(); the chain
+// needs a reset before it takes any more frames
+bool filter_chain_flush(FilterChain *chain);
+void filter_chain_print_stats(FilterChain *chain, const char *name,
+        FILE *fp);
+
+static inline bool filter_stage_enabled(FilterStage *stage) {
+    return stage->chain.count > 0;
+}
@@ -0,0 +1,432 @@
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <SDL2/SDL.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "input.h"
+#include "macro.h"
+
+// size of the buffer libavformat reads through, and of
+// the chunks the I/O thread reads from storage
+#define AVIO_BUFFER_SIZE (64 * 1024)
+#define READ_CHUNK_SIZE (256 * 1024)
+
+// how much the I/O thread may buffer; for streams with a known
+// byte rate that's bounded by max_ms, to bound the latency
+static int fill_limit(Input *in) {
+    if (in->mode != INPUT_STREAM || !in->max_ms || !in->byte_rate)
+        return in->ring_size;
+    int64_t limit = in->byte_rate * in->max_ms / 1000;
+    return max(min(limit, (int64_t)in->ring_size),
+            (int64_t)min(AVIO_BUFFER_SIZE, in->ring_size));
+}
+
+static bool readable(Input *in) {
+    if (in->eof || in->error)
+        return true;
+    if (!in->buffering)
+        return in->count > 0;
+    int64_t target = in->byte_rate * in->prebuffer_ms / 1000;
+    return in->count > 0 &&
+        in->count >= min(target, (int64_t)fill_limit(in));
+}
+
+static int buffered_read(void *opaque, uint8_t *buf, int size) {
+    Input *in = opaque;
+    ASSERT(SDL_LockMutex(in->mutex) == 0);
+
+    in->stats.reads++;
+    if (in->mode == INPUT_STREAM && in->count == 0 &&
+            in->stats.bytes_read > 0 && !in->eof && !in->error) {
+        // the writer fell behind, so let the jitter buffer
+        // fill up again before we go on
+        in->stats.underruns++;
+        in->buffering = true;
+    }
+    if (!readable(in)) {
+        in->stats.stalls++;
+        while (!readable(in))
+            ASSERT(SDL_CondWait(in->data, in->mutex) == 0);
+    } else {
+        in->stats.hits++;
+    }
+    in->buffering = false;
+    if (in->count == 0) {
+        int err = in->error ? in->error : AVERROR_EOF;
+        ASSERT(SDL_UnlockMutex(in->mutex) == 0);
+        return err;
+    }
+
+    // the ring may wrap, in which case it takes two copies
+    int n = min(size, in->count);
+    int first = min(n, in->ring_size - in->start);
+    memcpy(buf, &in->ring[in->start], first);
+    memcpy(buf + first, in->ring, n - first);
+    in->start = (in->start + n) % in->ring_size;
+    in->count -= n;
+    in->pos += n;
+    in->stats.bytes_read += n;
+
+    ASSERT(SDL_CondSignal(in->space) == 0);
+    ASSERT(SDL_UnlockMutex(in->mutex) == 0);
+    return n;
+}
+
+static int64_t buffered_seek(void *opaque, int64_t offset, int whence) {
+    Input *in = opaque;
+
+    if (whence & AVSEEK_SIZE)
+        return in->size;
+    whence &= ~AVSEEK_FORCE;
+
+    ASSERT(SDL_LockMutex(in->mutex) == 0);
+    if (whence == SEEK_CUR)
+        offset += in->pos;
+    else if (whence == SEEK_END)
+        offset += in->size;
+    else if (whence != SEEK_SET) {
+        ASSERT(SDL_UnlockMutex(in->mutex) == 0);
+        return AVERROR(EINVAL);
+    }
+    if (offset < 0) {
+        ASSERT(SDL_UnlockMutex(in->mutex) == 0);
+        return AVERROR(EINVAL);
+    }
+
+    in->stats.seeks++;
+    if (offset >= in->pos && offset <= in->pos + in->count) {
+        // forward seek inside what's already read ahead,
+        // so just skip over it
+        int skip = offset - in->pos;
+        in->start = (in->start + skip) % in->ring_size;
+        in->count -= skip;
+        in->stats.seek_hits++;
+    } else {
+        // start over at the new offset, and make the I/O thread
+        // throw away whatever read it has in flight
+        in->start = 0;
+        in->count = 0;
+        in->eof = false;
+        in->error = 0;
+        in->gen++;
+    }
+    in->pos = offset;
+
+    ASSERT(SDL_CondSignal(in->space) == 0);
+    ASSERT(SDL_UnlockMutex(in->mutex) == 0);
+    return offset;
+}
+
+static int io_thread(void *ptr) {
+    Input *in = ptr;
+    ASSERT(SDL_LockMutex(in->mutex) == 0);
+    while (!in->quit) {
+        int limit = fill_limit(in);
+        if (in->eof || in->error || in->count >= limit) {
+            ASSERT(SDL_CondWait(in->space, in->mutex) == 0);
+            continue;
+        }
+
+        // append to the ring, up to its end (we wrap on
+        // the next round) and at most one chunk at a time
+        int end = (in->start + in->count) % in->ring_size;
+        int len = min(limit - in->count, in->ring_size - end);
+        len = min(len, READ_CHUNK_SIZE);
+        int64_t offset = in->pos + in->count;
+        unsigned gen = in->gen;
+
+        // the reader never touches the free part of the ring,
+        // so the read can go on without the lock
+        ASSERT(SDL_UnlockMutex(in->mutex) == 0);
+        ssize_t n = in->mode == INPUT_STREAM
+            ? read(in->fd, &in->ring[end], len)
+            : pread(in->fd, &in->ring[end], len, offset);
+        int err = errno;
+        ASSERT(SDL_LockMutex(in->mutex) == 0);
+
+        if (gen != in->gen)
+            continue;
+        if (n < 0) {
+            if (err == EINTR)
+                continue;
+            LOG_ERROR("Error reading input: %s\n", strerror(err));
+            in->error = AVERROR(err);
+        } else if (n == 0) {
+            in->eof = true;
+        } else {
+            in->count += n;
+            in->stats.bytes_fetched += n;
+        }
+        ASSERT(SDL_CondSignal(in->data) == 0);
+    }
+    ASSERT(SDL_UnlockMutex(in->mutex) == 0);
+    return 0;
+}
+
+// asks the kernel to start paging in the next stretch of the
+// file before the demuxer gets there, and reports whether the
+// range about to be read is resident already
+static bool mmap_prefetch(Input *in, int64_t pos, int len) {
+    long page = sysconf(_SC_PAGESIZE);
+    int64_t lo = pos / page * page;
+    int64_t hi = pos + len;
+
+    if (hi > in->advised - in->ring_size / 2) {
+        int64_t end = min(hi + in->ring_size, in->size);
+        int64_t from = max(in->advised, lo);
+        if (end > from) {
+            (void)madvise(in->map + from, end - from, MADV_WILLNEED);
+            in->stats.bytes_fetched += end - from;
+            in->advised = end;
+        }
+    }
+
+    unsigned char vec[64];
+    int64_t npages = min((hi - lo + page - 1) / page,
+            (int64_t)sizeof vec);
+    if (mincore(in->map + lo, npages * page, vec) < 0)
+        return true;
+    for (int i = 0; i < npages; i++)
+        if (!(vec[i] & 1))
+            return false;
+    return true;
+}
+
+static int mmap_read(void *opaque, uint8_t *buf, int size) {
+    Input *in = opaque;
+    if (in->pos >= in->size)
+        return AVERROR_EOF;
+
+    int n = min((int64_t)size, in->size - in->pos);
+    in->stats.reads++;
+    if (mmap_prefetch(in, in->pos, n))
+        in->stats.hits++;
+    else
+        in->stats.stalls++;
+    memcpy(buf, in->map + in->pos, n);
+    in->pos += n;
+    in->stats.bytes_read += n;
+    return n;
+}
+
+static int64_t mmap_seek(void *opaque, int64_t offset, int whence) {
+    Input *in = opaque;
+
+    if (whence & AVSEEK_SIZE)
+        return in->size;
+    whence &= ~AVSEEK_FORCE;
+
+    if (whence == SEEK_CUR)
+        offset += in->pos;
+    else if (whence == SEEK_END)
+        offset += in->size;
+    else if (whence != SEEK_SET)
+        return AVERROR(EINVAL);
+    if (offset < 0)
+        return AVERROR(EINVAL);
+
+    in->stats.seeks++;
+    if (offset >= in->pos && offset < in->advised)
+        in->stats.seek_hits++;
+    else
+        in->advised = offset;
+    in->pos = offset;
+    return offset;
+}
+
+bool input_is_stream(const char *url) {
+    return strcmp(url, "-") == 0 ||
+        strncmp(url, "pipe:", 5) == 0 ||
+        strncmp(url, "unix:", 5) == 0;
+}
+
+// opens stdin ("-" or "pipe:"), an inherited descriptor
+// ("pipe:N") or a local socket ("unix:PATH")
+static bool open_stream(Input *in, const char *url) {
+    if (strncmp(url, "unix:", 5) == 0) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        const char *path = url + 5;
+        if (strlen(path) >= sizeof addr.sun_path) {
+            LOG_ERROR("Socket path too long: %s\n", path);
+            return false;
+        }
+        strcpy(addr.sun_path, path);
+        in->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        in->own_fd = true;
+        if (in->fd < 0 || connect(in->fd,
+                    (struct sockaddr *)&addr, sizeof addr) < 0) {
+            fprintf(stderr, "Error connecting to '%s': %s\n", path,
+                    strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    in->fd = STDIN_FILENO;
+    if (strncmp(url, "pipe:", 5) == 0 && url[5] != '\0') {
+        char *end;
+        in->fd = strtol(url + 5, &end, 10);
+        if (*end != '\0' || in->fd < 0) {
+            LOG_ERROR("Invalid pipe: %s\n", url);
+            in->fd = -1;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool input_init(Input *in, const char *url,
+        InputMode mode, int buffer_size) {
+    struct stat st;
+
+    memset(in, 0, sizeof *in);
+    in->mode = mode;
+    in->fd = -1;
+    in->size = -1;
+    in->ring_size = buffer_size;
+    if (mode == INPUT_DEFAULT)
+        return true;
+
+    if (mode == INPUT_STREAM) {
+        if (!open_stream(in, url))
+            return false;
+    } else {
+        // we read the file ourselves, so only plain paths will do
+        if (strncmp(url, "file:", 5) == 0)
+            url += 5;
+        else if (strstr(url, "://")) {
+            LOG_ERROR("Custom I/O only supports local files: %s\n", url);
+            return false;
+        }
+
+        in->fd = open(url, O_RDONLY);
+        in->own_fd = true;
+        if (in->fd < 0 || fstat(in->fd, &st) < 0) {
+            fprintf(stderr, "Error opening file '%s': %s\n", url,
+                    strerror(errno));
+            return false;
+        }
+        in->size = st.st_size;
+    }
+
+    int (*read_packet)(void *, uint8_t *, int);
+    int64_t (*seek)(void *, int64_t, int);
+    if (mode == INPUT_MMAP) {
+        in->map = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+        if (in->map == MAP_FAILED) {
+            in->map = NULL;
+            LOG_ERROR("Error mapping file: %s\n", strerror(errno));
+            return false;
+        }
+        (void)madvise(in->map, in->size, MADV_SEQUENTIAL);
+        read_packet = mmap_read;
+        seek = mmap_seek;
+    } else {
+        in->ring = av_malloc(in->ring_size);
+        in->mutex = SDL_CreateMutex();
+        in->data = SDL_CreateCond();
+        in->space = SDL_CreateCond();
+        if (!in->ring || !in->mutex || !in->data || !in->space) {
+            LOG_ERROR("Error allocating input buffer\n");
+            return false;
+        }
+        in->thread = SDL_CreateThread(io_thread, "io_thread", in);
+        if (!in->thread) {
+            LOG_ERROR("Error launching I/O thread\n");
+            return false;
+        }
+        read_packet = buffered_read;
+        // streams can't seek, and libavformat knows
+        // that when there's no seek callback
+        seek = mode == INPUT_STREAM ? NULL : buffered_seek;
+    }
+
+    uint8_t *buf = av_malloc(AVIO_BUFFER_SIZE);
+    if (!buf) {
+        LOG_ERROR("Error allocating AVIO buffer\n");
+        return false;
+    }
+    in->pb = avio_alloc_context(buf, AVIO_BUFFER_SIZE, 0, in,
+            read_packet, NULL, seek);
+    if (!in->pb) {
+        av_free(buf);
+        LOG_ERROR("Error allocating AVIO context\n");
+        return false;
+    }
+    return true;
+}
+
+void input_set_jitter(Input *in, int prebuffer_ms, int max_ms) {
+    if (in->mutex)
+        ASSERT(SDL_LockMutex(in->mutex) == 0);
+    in->prebuffer_ms = prebuffer_ms;
+    in->max_ms = max_ms;
+    if (in->mutex)
+        ASSERT(SDL_UnlockMutex(in->mutex) == 0);
+}
+
+void input_set_byte_rate(Input *in, int64_t byte_rate) {
+    if (!in->mutex)
+        return;
+    ASSERT(SDL_LockMutex(in->mutex) == 0);
+    in->byte_rate = byte_rate;
+    // the fill limit may have grown
+    ASSERT(SDL_CondSignal(in->space) == 0);
+    ASSERT(SDL_UnlockMutex(in->mutex) == 0);
+}
+
+void input_fini(Input *in) {
+    if (in->thread) {
+        ASSERT(SDL_LockMutex(in->mutex) == 0);
+        in->quit = true;
+        ASSERT(SDL_CondSignal(in->space) == 0);
+        ASSERT(SDL_UnlockMutex(in->mutex) == 0);
+        SDL_WaitThread(in->thread, NULL);
+        in->thread = NULL;
+    }
+    if (in->pb) {
+        // the context may have swapped the buffer we gave it
+        av_freep(&in->pb->buffer);
+        avio_context_free(&in->pb);
+    }
+    if (in->map) {
+        munmap(in->map, in->size);
+        in->map = NULL;
+    }
+    if (in->fd >= 0 && in->own_fd) {
+        close(in->fd);
+        in->fd = -1;
+    }
+    av_freep(&in->ring);
+    SDL_DestroyCond(in->data);
+    SDL_DestroyCond(in->space);
+    SDL_DestroyMutex(in->mutex);
+    in->data = in->space = NULL;
+    in->mutex = NULL;
+}
+
+void input_print_stats(Input *in, FILE *fp) {
+    InputStats *s = &in->stats;
+    if (in->mode == INPUT_DEFAULT)
+        return;
+    fprintf(fp, "input: read %llu bytes, fetched %llu bytes, "
+            "%llu reads (%.1f%% hit, %llu stalls, %llu underruns), "
+            "%llu seeks (%llu in buffer)\n",
+            (unsigned long long)s->bytes_read,
+            (unsigned long long)s->bytes_fetched,
+            (unsigned long long)s->reads,
+            s->reads ? 100.0 * s->hits / s->reads : 0.0,
+            (unsigned long long)s->stalls,
+            (unsigned long long)s->underruns,
+            (unsigned long long)s->seeks,
+            (unsigned long long)s->seek_hits);
+}
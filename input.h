@@ -0,0 +1,67 @@
+#pragma once
+#include <libavformat/avformat.h>
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+    INPUT_DEFAULT,      // let libavformat open the url itself
+    INPUT_BUFFERED,     // read-ahead ring filled by an I/O thread
+    INPUT_MMAP,         // file mapped into memory
+    INPUT_STREAM,       // pipe or socket, through a jitter buffer
+} InputMode;
+
+typedef struct {
+    uint64_t bytes_read;    // handed to the demuxer
+    uint64_t bytes_fetched; // read (or prefetched) from storage
+    uint64_t reads;         // read requests from the demuxer
+    uint64_t hits;          // requests served without waiting on I/O
+    uint64_t stalls;        // requests that had to wait on I/O
+    uint64_t seeks;
+    uint64_t seek_hits;     // seeks that landed inside the buffer
+    uint64_t underruns;     // times a stream input ran dry
+} InputStats;
+
+typedef struct {
+    InputMode mode;
+    AVIOContext *pb;
+    int fd;
+    bool own_fd;
+    int64_t size;
+    int64_t pos;        // offset the demuxer reads from next
+
+    // INPUT_BUFFERED: the ring holds [pos, pos + count)
+    // starting at index start, and the I/O thread keeps
+    // appending to it
+    uint8_t *ring;
+    int ring_size;
+    int start, count;
+    bool eof, quit;
+    int error;
+    unsigned gen;       // bumped on seek, invalidates reads in flight
+
+    // INPUT_STREAM: the ring doubles as a jitter buffer. It's
+    // refilled to prebuffer_ms worth of data after running dry,
+    // and kept under max_ms worth, once we know the byte rate
+    int prebuffer_ms, max_ms;
+    int64_t byte_rate;
+    bool buffering;
+    SDL_Thread *thread;
+    SDL_mutex *mutex;
+    SDL_cond *data, *space;
+
+    // INPUT_MMAP
+    uint8_t *map;
+    int64_t advised;    // end of the range we asked to be paged in
+
+    InputStats stats;
+} Input;
+
+bool input_is_stream(const char *url);
+bool input_init(Input *in, const char *url,
+        InputMode mode, int buffer_size);
+void input_set_jitter(Input *in, int prebuffer_ms, int max_ms);
+void input_set_byte_rate(Input *in, int64_t byte_rate);
+void input_fini(Input *in);
+void input_print_stats(Input *in, FILE *fp);
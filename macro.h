@@ -1,7 +1,6 @@
 #pragma once
 
 #define DEFAULT_FRAME_DELAY 16
-#define MAX_BUFFER_SIZE (32 * 1024)
 
 #define _unlikely_(x) __builtin_expect(!!(x), 0)
 #define _cleanup_(x) __attribute__((cleanup(x)))
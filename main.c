@@ -0,0 +1,35 @@
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "opts.h"
+#include "player.h"
+#include "thumbs.h"
+#include "wall.h"
+
+int main(int argc, char *argv[]) {
+    Options opts;
+    if (!opts_parse(&opts, argc, argv))
+        exit(1);
+
+    // contact sheets are made without SDL, bar its threads
+    if (opts.contact_sheet)
+        return thumbs_run(&opts) ? 0 : 1;
+    if (opts.wall) {
+        bool ok = wall_run(&opts);
+        SDL_Quit();
+        return ok ? 0 : 1;
+    }
+
+    Player *p = player_open(&opts);
+    if (!p) {
+        SDL_Quit();
+        exit(1);
+    }
+    player_play(p);
+    bool ok = player_run(&p, 1);
+    player_print_stats(p, stdout);
+    player_close(p);
+    SDL_Quit();
+
+    return ok ? 0 : 1;
+}
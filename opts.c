@@ -0,0 +1,310 @@
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opts.h"
+
+#define DEFAULT_IO_BUFFER_SIZE (16 * 1024 * 1024)
+#define DEFAULT_PREBUFFER_MS 200
+#define DEFAULT_AUDIO_BUFFER 1024
+#define DEFAULT_STEP_CACHE (256 * 1024 * 1024)
+#define DEFAULT_REPEAT_CACHE (256 * 1024 * 1024)
+#define DEFAULT_THUMBNAILS 16
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] input_file...\n"
+            "input_file may be '-' or 'pipe:[N]' to read from stdin or\n"
+            "file descriptor N, or 'unix:PATH' to read from a socket;\n"
+            "more than one makes a playlist, played without gaps\n"
+            "Options:\n"
+            "  --io=MODE           read the input with MODE: default,\n"
+            "                      buffered (read-ahead thread) or mmap\n"
+            "  --io-buffer=SIZE    read-ahead size for buffered/mmap I/O,\n"
+            "                      with optional k/M suffix (default 16M)\n"
+            "  --prebuffer=MS      for pipes/sockets, how much to buffer\n"
+            "                      again after the input ran dry (default 200)\n"
+            "  --max-latency=MS    for pipes/sockets, buffer at most this\n"
+            "                      much (default: up to --io-buffer)\n"
+            "  --low-latency       probe as little of the input as possible\n"
+            "                      and don't buffer packets while probing\n"
+            "  --probesize=SIZE    read at most SIZE bytes to probe streams\n"
+            "  --analyzeduration=MS\n"
+            "                      analyze at most MS of the streams\n"
+            "  --skip-probe        skip stream probing when the container\n"
+            "                      headers have all we need\n"
+            "  --downmix           play surround audio as stereo\n"
+            "  --audio-buffer=N    audio device buffer size in samples,\n"
+            "                      a power of two (default 1024); smaller\n"
+            "                      means lower latency\n"
+            "  --audio-push        queue audio to the device rather than\n"
+            "                      have it pull from a callback\n"
+            "  --speed=X           start playing at X times normal speed,\n"
+            "                      from 0.25 to 4\n"
+            "  --step-cache=SIZE   memory for decoded frames kept for\n"
+            "                      frame stepping (default 256M)\n"
+            "  --loop              start over from the beginning at the end\n"
+            "  --repeat-cache=SIZE memory for decoded frames kept for\n"
+            "                      looping and A-B repeat (default 256M)\n"
+            "  --decoder-threads=N threads per decoder (default: up to\n"
+            "                      libavcodec)\n"
+            "  --vf=FILTERS        run decoded video through a libavfilter\n"
+            "                      chain, e.g. yadif,crop=1280:720\n"
+            "  --af=FILTERS        run decoded audio through a libavfilter\n"
+            "                      chain, e.g. loudnorm\n"
+            "  --control=PATH      take commands and answer with stats on\n"
+            "                      a local socket at PATH\n"
+            "  --wall              play all inputs at once in a grid, in\n"
+            "                      one window, on a shared decode pool\n"
+            "  --contact-sheet=FILE don't play; write a contact sheet of\n"
+            "                      keyframe thumbnails to FILE (PNG)\n"
+            "  --thumbnails=N      thumbnails on the sheet (default 16)\n",
+            prog);
+}
+
+// parses a size with an optional k/M suffix
+static bool parse_size(const char *s, int *out) {
+    char *end;
+    long val = strtol(s, &end, 10);
+    if (end == s || val <= 0)
+        return false;
+    if (*end == 'k' || *end == 'K') {
+        val *= 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        val *= 1024 * 1024;
+        end++;
+    }
+    if (*end != '\0' || val > INT_MAX)
+        return false;
+    *out = val;
+    return true;
+}
+
+static bool parse_int(const char *s, int *out) {
+    char *end;
+    long val = strtol(s, &end, 10);
+    if (end == s || *end != '\0' || val < 0 || val > INT_MAX)
+        return false;
+    *out = val;
+    return true;
+}
+
+// the defaults, with no inputs; for those embedding the
+// player, who fill in the urls themselves
+void opts_init(Options *opts) {
+    opts->urls = NULL;
+    opts->nb_urls = 0;
+    opts->io_mode = INPUT_DEFAULT;
+    opts->io_buffer_size = DEFAULT_IO_BUFFER_SIZE;
+    opts->prebuffer_ms = DEFAULT_PREBUFFER_MS;
+    opts->max_latency_ms = 0;
+    opts->low_latency = false;
+    opts->probesize = 0;
+    opts->analyze_ms = -1;
+    opts->skip_probe = false;
+    opts->downmix = false;
+    opts->audio_buffer = DEFAULT_AUDIO_BUFFER;
+    opts->audio_push = false;
+    opts->speed = 1.0;
+    opts->step_cache = DEFAULT_STEP_CACHE;
+    opts->loop = false;
+    opts->repeat_cache = DEFAULT_REPEAT_CACHE;
+    opts->decoder_threads = 0;
+    opts->vf = NULL;
+    opts->af = NULL;
+    opts->control = NULL;
+    opts->wall = false;
+    opts->contact_sheet = NULL;
+    opts->thumbnails = DEFAULT_THUMBNAILS;
+}
+
+bool opts_parse(Options *opts, int argc, char *argv[]) {
+    enum {
+        OPT_IO = 256,
+        OPT_IO_BUFFER,
+        OPT_PREBUFFER,
+        OPT_MAX_LATENCY,
+        OPT_LOW_LATENCY,
+        OPT_PROBESIZE,
+        OPT_ANALYZEDURATION,
+        OPT_SKIP_PROBE,
+        OPT_DOWNMIX,
+        OPT_AUDIO_BUFFER,
+        OPT_AUDIO_PUSH,
+        OPT_SPEED,
+        OPT_STEP_CACHE,
+        OPT_LOOP,
+        OPT_REPEAT_CACHE,
+        OPT_DECODER_THREADS,
+        OPT_VF,
+        OPT_AF,
+        OPT_CONTROL,
+        OPT_WALL,
+        OPT_CONTACT_SHEET,
+        OPT_THUMBNAILS,
+    };
+    static const struct option long_opts[] = {
+        { "io",              required_argument, NULL, OPT_IO },
+        { "io-buffer",       required_argument, NULL, OPT_IO_BUFFER },
+        { "prebuffer",       required_argument, NULL, OPT_PREBUFFER },
+        { "max-latency",     required_argument, NULL, OPT_MAX_LATENCY },
+        { "low-latency",     no_argument,       NULL, OPT_LOW_LATENCY },
+        { "probesize",       required_argument, NULL, OPT_PROBESIZE },
+        { "analyzeduration", required_argument, NULL, OPT_ANALYZEDURATION },
+        { "skip-probe",      no_argument,       NULL, OPT_SKIP_PROBE },
+        { "downmix",         no_argument,       NULL, OPT_DOWNMIX },
+        { "audio-buffer",    required_argument, NULL, OPT_AUDIO_BUFFER },
+        { "audio-push",      no_argument,       NULL, OPT_AUDIO_PUSH },
+        { "speed",           required_argument, NULL, OPT_SPEED },
+        { "step-cache",      required_argument, NULL, OPT_STEP_CACHE },
+        { "loop",            no_argument,       NULL, OPT_LOOP },
+        { "repeat-cache",    required_argument, NULL, OPT_REPEAT_CACHE },
+        { "decoder-threads", required_argument, NULL, OPT_DECODER_THREADS },
+        { "vf",              required_argument, NULL, OPT_VF },
+        { "af",              required_argument, NULL, OPT_AF },
+        { "control",         required_argument, NULL, OPT_CONTROL },
+        { "wall",            no_argument,       NULL, OPT_WALL },
+        { "contact-sheet",   required_argument, NULL, OPT_CONTACT_SHEET },
+        { "thumbnails",      required_argument, NULL, OPT_THUMBNAILS },
+        { "help",            no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    opts_init(opts);
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", long_opts, NULL)) != -1) {
+        switch (c) {
+        case OPT_IO:
+            if (strcmp(optarg, "default") == 0) {
+                opts->io_mode = INPUT_DEFAULT;
+            } else if (strcmp(optarg, "buffered") == 0) {
+                opts->io_mode = INPUT_BUFFERED;
+            } else if (strcmp(optarg, "mmap") == 0) {
+                opts->io_mode = INPUT_MMAP;
+            } else {
+                fprintf(stderr, "Unknown I/O mode: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_IO_BUFFER:
+            if (!parse_size(optarg, &opts->io_buffer_size)) {
+                fprintf(stderr, "Invalid buffer size: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_PREBUFFER:
+        case OPT_MAX_LATENCY:
+            if (!parse_int(optarg, c == OPT_PREBUFFER
+                        ? &opts->prebuffer_ms
+                        : &opts->max_latency_ms)) {
+                fprintf(stderr, "Invalid duration: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_LOW_LATENCY:
+            opts->low_latency = true;
+            break;
+        case OPT_PROBESIZE:
+            if (!parse_size(optarg, &opts->probesize)) {
+                fprintf(stderr, "Invalid probe size: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_ANALYZEDURATION:
+            if (!parse_int(optarg, &opts->analyze_ms)) {
+                fprintf(stderr, "Invalid duration: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_SKIP_PROBE:
+            opts->skip_probe = true;
+            break;
+        case OPT_DOWNMIX:
+            opts->downmix = true;
+            break;
+        case OPT_AUDIO_BUFFER:
+            // SDL's buffer size is 16 bits, and has to
+            // be a power of two
+            if (!parse_int(optarg, &opts->audio_buffer) ||
+                    opts->audio_buffer < 16 ||
+                    opts->audio_buffer > 32768 ||
+                    (opts->audio_buffer & (opts->audio_buffer - 1))) {
+                fprintf(stderr, "Invalid audio buffer size: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_AUDIO_PUSH:
+            opts->audio_push = true;
+            break;
+        case OPT_STEP_CACHE:
+            if (!parse_size(optarg, &opts->step_cache)) {
+                fprintf(stderr, "Invalid cache size: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_LOOP:
+            opts->loop = true;
+            break;
+        case OPT_REPEAT_CACHE:
+            if (!parse_size(optarg, &opts->repeat_cache)) {
+                fprintf(stderr, "Invalid cache size: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_DECODER_THREADS:
+            if (!parse_int(optarg, &opts->decoder_threads)) {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_VF:
+            opts->vf = optarg;
+            break;
+        case OPT_AF:
+            opts->af = optarg;
+            break;
+        case OPT_CONTROL:
+            opts->control = optarg;
+            break;
+        case OPT_WALL:
+            opts->wall = true;
+            break;
+        case OPT_CONTACT_SHEET:
+            opts->contact_sheet = optarg;
+            break;
+        case OPT_THUMBNAILS:
+            if (!parse_int(optarg, &opts->thumbnails) ||
+                    opts->thumbnails < 1 || opts->thumbnails > 1024) {
+                fprintf(stderr, "Invalid thumbnail count: %s\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_SPEED: {
+            char *end;
+            opts->speed = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' ||
+                    !(opts->speed >= 0.25 && opts->speed <= 4.0)) {
+                fprintf(stderr, "Invalid speed: %s\n", optarg);
+                return false;
+            }
+            break;
+        }
+        case 'h':
+        default:
+            usage(argv[0]);
+            return false;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        return false;
+    }
+    // anything after the first input makes a playlist
+    opts->urls = &argv[optind];
+    opts->nb_urls = argc - optind;
+    return true;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <stdbool.h>
+#include "input.h"
+
+typedef struct {
+    char **urls;        // the playlist, from the command line
+    int nb_urls;
+    InputMode io_mode;
+    int io_buffer_size;
+    int prebuffer_ms;
+    int max_latency_ms;
+    bool low_latency;
+    int probesize;      // 0 for the default
+    int analyze_ms;     // -1 for the default
+    bool skip_probe;
+    bool downmix;
+    int audio_buffer;   // device buffer size, in samples
+    bool audio_push;
+    double speed;
+    int step_cache;     // bytes of decoded frames kept for stepping
+    bool loop;
+    int repeat_cache;   // bytes of decoded frames kept for repeats
+    int decoder_threads;    // 0 for libavcodec's default
+    const char *vf;     // libavfilter chains for decoded video/audio
+    const char *af;
+    const char *control;    // socket to take commands on
+    bool wall;          // play all inputs at once, in a grid
+    const char *contact_sheet;  // write one here instead of playing
+    int thumbnails;     // how many go on it
+} Options;
+
+void opts_init(Options *opts);
+bool opts_parse(Options *opts, int argc, char *argv[]);
@@ -3,11 +3,21 @@
 #include <libavutil/avutil.h>
 #include <SDL2/SDL.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "clock.h"
 #include "macro.h"
 #include "param.h"
 
+// how much to probe with --low-latency; enough for the
+// headers of most containers
+#define LOW_LATENCY_PROBESIZE (32 * 1024)
+#define LOW_LATENCY_ANALYZE_DURATION (AV_TIME_BASE / 10)
+
+// threads is the decoder's thread count, or 0 to leave
+// that up to libavcodec
 static bool get_codec_context(AVFormatContext *avctx,
-        int stream_index, AVCodecContext **out) {
+        int stream_index, int threads, AVCodecContext **out) {
     AVCodecParameters *codec_param;
     const AVCodec *codec;
     AVCodecContext *codec_ctx;
@@ -30,6 +40,8 @@ static bool get_codec_context(AVFormatContext *avctx,
         LOG_ERROR("Error copying codec context: %s\n", av_err2str(err));
         return false;
     }
+    if (threads > 0)
+        codec_ctx->thread_count = threads;
     err = avcodec_open2(codec_ctx, codec, NULL);
     if (err < 0) {
         LOG_ERROR("Error opening codec context: %s\n", av_err2str(err));
@@ -42,22 +54,102 @@ static bool get_codec_context(AVFormatContext *avctx,
     return true;
 }
 
-bool avparam_init(avparam_t *param, const char *url) {
+// the byte rate of the input, used to size the jitter buffer
+// of stream inputs in terms of duration
+static int64_t byte_rate(AVFormatContext *avctx) {
+    int64_t bit_rate = avctx->bit_rate;
+    if (bit_rate <= 0) {
+        bit_rate = 0;
+        for (unsigned i = 0; i < avctx->nb_streams; i++)
+            bit_rate += max(avctx->streams[i]->codecpar->bit_rate,
+                    (int64_t)0);
+    }
+    return bit_rate / 8;
+}
+
+// whether the container headers alone tell us enough to set up
+// decoding and playback, so stream info probing can be skipped
+static bool have_stream_params(AVFormatContext *avctx) {
+    int video_si = av_find_best_stream(
+            avctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    int audio_si = av_find_best_stream(
+            avctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if (video_si < 0 || audio_si < 0)
+        return false;
+    AVCodecParameters *video = avctx->streams[video_si]->codecpar;
+    AVCodecParameters *audio = avctx->streams[audio_si]->codecpar;
+    return video->width > 0 && video->height > 0 &&
+        audio->sample_rate > 0 && audio->ch_layout.nb_channels > 0;
+}
+
+// opens the input, probes it and opens the decoders; this is
+// all that differs between playlist items, and what takes time
+bool avparam_open(avparam_t *param, const char *url,
+        const Options *opts) {
     int err;
     bool ret;
 
+    memset(&param->startup, 0, sizeof param->startup);
+    param->startup.start = clock_now();
+    param->video_si = param->audio_si = param->sub_si = -1;
+
+    // the I/O callbacks point at the input, so it stays put
+    // when an item opened ahead takes over
+    param->input = calloc(1, sizeof *param->input);
+    if (!param->input) {
+        LOG_ERROR("Error allocating input\n");
+        return false;
+    }
+    // pipes and sockets always go through our own jitter buffer
+    InputMode mode = input_is_stream(url) ? INPUT_STREAM : opts->io_mode;
+    if (!input_init(param->input, url, mode, opts->io_buffer_size))
+        return false;
+    input_set_jitter(param->input,
+            opts->prebuffer_ms, opts->max_latency_ms);
+
+    param->avctx = avformat_alloc_context();
+    if (!param->avctx) {
+        LOG_ERROR("Error allocating format context\n");
+        return false;
+    }
+    // NULL, unless we do the I/O ourselves
+    param->avctx->pb = param->input->pb;
+    if (opts->low_latency) {
+        // stop probing as soon as we can, and don't
+        // hold on to packets while doing it
+        param->avctx->probesize = LOW_LATENCY_PROBESIZE;
+        param->avctx->max_analyze_duration =
+            LOW_LATENCY_ANALYZE_DURATION;
+        param->avctx->flags |= AVFMT_FLAG_NOBUFFER;
+    }
+    if (opts->probesize > 0)
+        param->avctx->probesize = opts->probesize;
+    if (opts->analyze_ms >= 0)
+        param->avctx->max_analyze_duration =
+            (int64_t)opts->analyze_ms * AV_TIME_BASE / 1000;
+
     err = avformat_open_input(&param->avctx, url, NULL, NULL);
     if (err < 0) {
         fprintf(stderr, "Error opening file '%s': %s\n", url,
                 av_err2str(err));
         return false;
     }
-    err = avformat_find_stream_info(param->avctx, NULL);
-    if (err < 0) {
-        LOG_ERROR("Error getting stream info: %s\n", av_err2str(err));
-        return false;
+    param->startup.opened = clock_now();
+
+    // probing decodes a bit of every stream, which takes time
+    // we'd rather not spend if the headers say all we need
+    if (!opts->skip_probe || !have_stream_params(param->avctx)) {
+        if (opts->skip_probe)
+            fprintf(stderr, "Headers incomplete, probing streams\n");
+        err = avformat_find_stream_info(param->avctx, NULL);
+        if (err < 0) {
+            LOG_ERROR("Error getting stream info: %s\n", av_err2str(err));
+            return false;
+        }
     }
+    param->startup.probed = clock_now();
     // av_dump_format(param->avctx, 0, url, 0);
+    input_set_byte_rate(param->input, byte_rate(param->avctx));
 
     param->video_si = av_find_best_stream(
             param->avctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
@@ -71,22 +163,64 @@ bool avparam_init(avparam_t *param, const char *url) {
     }
 
     ret = get_codec_context(param->avctx,
-            param->video_si, &param->video_ctx);
+            param->video_si, opts->decoder_threads, &param->video_ctx);
     if (!ret) return false;
     ret = get_codec_context(param->avctx,
-            param->audio_si, &param->audio_ctx);
+            param->audio_si, opts->decoder_threads, &param->audio_ctx);
     if (!ret) return false;
     if (param->sub_si >= 0) {
         ret = get_codec_context(param->avctx,
-                param->sub_si, &param->sub_ctx);
+                param->sub_si, opts->decoder_threads, &param->sub_ctx);
         if (!ret) return false;
         printf("%.*s\n", param->sub_ctx->subtitle_header_size,
                 param->sub_ctx->subtitle_header);
     }
+    AVIOContext *pb = param->avctx->pb;
+    param->seekable = !pb || (pb->seekable & AVIO_SEEKABLE_NORMAL);
+    param->duration = param->avctx->duration;
+    param->startup.codecs_opened = clock_now();
+    return true;
+}
+
+void avparam_close(avparam_t *param) {
+    avcodec_free_context(&param->video_ctx);
+    avcodec_free_context(&param->audio_ctx);
+    avcodec_free_context(&param->sub_ctx);
+    avformat_close_input(&param->avctx);
+    // with custom I/O, closing the input leaves the pb to us
+    if (param->input) {
+        input_fini(param->input);
+        free(param->input);
+        param->input = NULL;
+    }
+}
+
+// hands over what src has open to dst, closing what dst had;
+// dst's sync objects and playback state stay as they are
+void avparam_switch(avparam_t *dst, avparam_t *src) {
+    avparam_close(dst);
+    dst->input = TAKE_PTR(src->input);
+    dst->avctx = TAKE_PTR(src->avctx);
+    dst->video_ctx = TAKE_PTR(src->video_ctx);
+    dst->audio_ctx = TAKE_PTR(src->audio_ctx);
+    dst->sub_ctx = TAKE_PTR(src->sub_ctx);
+    dst->video_si = src->video_si;
+    dst->audio_si = src->audio_si;
+    dst->sub_si = src->sub_si;
+    dst->seekable = src->seekable;
+    dst->duration = src->duration;
+    dst->startup = src->startup;
+}
+
+bool avparam_init(avparam_t *param, const char *url,
+        const Options *opts) {
+    if (!avparam_open(param, url, opts))
+        return false;
 
     param->seek_mtx = SDL_CreateMutex();
+    param->seek_req = SDL_CreateCond();
     param->seek_done = SDL_CreateCond();
-    if (!param->seek_mtx || !param->seek_done) {
+    if (!param->seek_mtx || !param->seek_req || !param->seek_done) {
         LOG_ERROR("Error creating mutex/cond\n");
         return false;
     }
@@ -95,17 +229,41 @@ bool avparam_init(avparam_t *param, const char *url) {
     param->do_seek = false;
     param->seek_flags = 0;
     param->seek_pts = 0;
+    param->seek_mode = SEEK_KEYFRAME;
+    param->scrub = false;
+    param->stepping = false;
     param->done = false;
     */
+    param->speed = opts->speed;
+    param->scrub_dir = 1;
+    param->scrub_rate = 4;
+    param->loop = opts->loop;
+    param->ab_a = param->ab_b = AV_NOPTS_VALUE;
 
     return true;
 }
 
 void avparam_fini(avparam_t *param) {
-    avcodec_free_context(&param->video_ctx);
-    avcodec_free_context(&param->audio_ctx);
-    avcodec_free_context(&param->sub_ctx);
-    avformat_close_input(&param->avctx);
+    avparam_close(param);
+    SDL_DestroyCond(param->seek_req);
     SDL_DestroyCond(param->seek_done);
     SDL_DestroyMutex(param->seek_mtx);
 }
+
+void avparam_print_startup(avparam_t *param, FILE *fp) {
+    startup_t *t = &param->startup;
+    // each phase is reported as the time since the previous one
+    fprintf(fp, "startup: open %.1f ms, probe %.1f ms, "
+            "codec open %.1f ms",
+            (t->opened - t->start) / 1000.0,
+            (t->probed - t->opened) / 1000.0,
+            (t->codecs_opened - t->probed) / 1000.0);
+    if (t->first_shown) {
+        fprintf(fp, ", first frame decoded %.1f ms, "
+                "presented %.1f ms, total %.1f ms",
+                (t->first_decoded - t->codecs_opened) / 1000.0,
+                (t->first_shown - t->first_decoded) / 1000.0,
+                (t->first_shown - t->start) / 1000.0);
+    }
+    fprintf(fp, "\n");
+}
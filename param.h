@@ -3,24 +3,88 @@
 #include <libavcodec/avcodec.h>
 #include <SDL2/SDL.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "input.h"
+#include "opts.h"
 
 /* #define PLAYER_DISP_MVS */
 
+// clock_now() timestamps of the startup phases
 typedef struct {
+    int64_t start;
+    int64_t opened;         // container headers read
+    int64_t probed;         // stream info known
+    int64_t codecs_opened;
+    int64_t first_decoded;  // first video frame decoded
+    int64_t first_shown;    // ... and presented
+} startup_t;
+
+typedef enum {
+    SEEK_KEYFRAME,  // start from the keyframe the seek lands on
+    SEEK_EXACT,     // drop what decodes before the seek target
+    SEEK_GOP,       // decode up to the target into the step cache
+} SeekMode;
+
+typedef struct {
+    Input *input;
     AVFormatContext *avctx;
     AVCodecContext *video_ctx;
     AVCodecContext *audio_ctx;
     AVCodecContext *sub_ctx;
     int video_si, audio_si, sub_si;
+    bool seekable;
+    // of the current item, or AV_NOPTS_VALUE; copied out of the
+    // format context so the main thread needn't look in there
+    int64_t duration;
 
     SDL_mutex *seek_mtx;
+    SDL_cond  *seek_req;
     SDL_cond  *seek_done;
     bool do_seek;
     int  seek_flags;
-    long seek_pts;
+    int64_t seek_pts;   // in AV_TIME_BASE units
+    SeekMode seek_mode;
+    // set by the fetch thread when it runs out of input without
+    // a video frame from after the last seek, which then never
+    // gets one on screen
+    bool seek_eof;
+
+    // playback speed, set by the main thread and picked up
+    // by the fetch and audio threads as they go
+    double speed;
+
+    // scrub mode: only keyframes get decoded, and no audio;
+    // they're stepped through in scrub_dir (1 or -1) and shown
+    // scrub_rate a second
+    bool scrub;
+    int scrub_dir;
+    int scrub_rate;
+
+    // set while stepping frames, which goes on without audio
+    bool stepping;
+
+    // loop mode goes back to the start at EOF, and A-B repeat
+    // from ab_a on reaching ab_b (file times, in AV_TIME_BASE
+    // units). Timestamps carry on regardless: the fetch thread
+    // adds pts_offset to each frame's best_effort_timestamp,
+    // and leaves pts as it is in the file
+    bool loop;
+    bool ab_active;
+    bool ab_restart;    // the next seek goes to A, to record A-B
+    int64_t ab_a, ab_b;
+    int64_t pts_offset;
 
     bool done;
+
+    startup_t startup;
 } avparam_t;
 
-bool avparam_init(avparam_t *param, const char *url);
+bool avparam_init(avparam_t *param, const char *url,
+        const Options *opts);
 void avparam_fini(avparam_t *param);
+bool avparam_open(avparam_t *param, const char *url,
+        const Options *opts);
+void avparam_close(avparam_t *param);
+void avparam_switch(avparam_t *dst, avparam_t *src);
+void avparam_print_startup(avparam_t *param, FILE *fp);
@@ -1,5 +1,4 @@
 #include <libavcodec/avcodec.h>
-#include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
 #include <libavutil/avutil.h>
 #include <SDL2/SDL.h>
@@ -8,34 +7,39 @@
 #include <stdlib.h>
 #include <string.h>
 #include "app.h"
+#include "audio.h"
+#include "cache.h"
+#include "clock.h"
+#include "control.h"
 #include "decode.h"
 #include "draw.h"
+#include "dsp.h"
+#include "filter.h"
 #include "macro.h"
+#include "opts.h"
 #include "param.h"
+#include "player.h"
+#include "playlist.h"
 #include "queue.h"
 
-Queue video_queue = {};
-Queue audio_queue = {};
-avparam_t avparam = {};
-static SDL_Thread *fetch_thread = NULL;
+// device buffers kept queued in push mode
+#define AUDIO_PUSH_BUFFERS 2
 
 static inline void sws_freectxp(struct SwsContext **pctx) {
     sws_freeContext(*pctx);
 }
 
-static void main_exit_handler() {
-    if (fetch_thread) {
-        avparam.done = true;
-        SDL_WaitThread(fetch_thread, NULL);
-        /* fetch_thread = NULL; */
-    }
-
-    avparam_fini(&avparam);
-    queue_fini(&video_queue);
-    queue_fini(&audio_queue);
+static bool update_aspect(App *app, AVFrame *frame) {
+    AVRational sar = frame->sample_aspect_ratio;
+    if (sar.num <= 0 || sar.den <= 0)
+        sar = (AVRational){ 1, 1 };
+    AVRational dar = av_mul_q(sar,
+            (AVRational){ frame->width, frame->height });
+    Rational display_aspect = { .num = dar.num, .den = dar.den };
+    return app_set_aspect(app, &display_aspect);
 }
 
-static void rescale_frame(App *app, AVFrame *frame) {
+static bool rescale_frame(App *app, AVFrame *frame) {
     _cleanup_(sws_freectxp) struct SwsContext *sws_ctx = NULL;
     sws_ctx = sws_getContext(
             frame->width, frame->height, frame->format,
@@ -43,7 +47,7 @@ static void rescale_frame(App *app, AVFrame *frame) {
             SWS_BILINEAR, NULL, NULL, NULL);
     if (!sws_ctx) {
         LOG_ERROR("Error getting swscale context\n");
-        exit(1);
+        return false;
     }
 
     uint8_t *pixels[1];
@@ -53,114 +57,186 @@ static void rescale_frame(App *app, AVFrame *frame) {
     int ret = sws_scale(
             sws_ctx, (const uint8_t * const *)frame->data,
             frame->linesize, 0, frame->height, pixels, pitch);
+    SDL_UnlockTexture(app->tex);
     if (ret != app->viewport.h) {
         LOG_ERROR("Error scaling frame\n");
-        exit(1);
+        return false;
     }
-    SDL_UnlockTexture(app->tex);
+    return true;
 }
 
-static AVFrame *resample_frame(SDL_AudioSpec *spec, AVFrame *frame) {
-    int err;
+// converts a frame's timestamp from its stream's time base,
+// which the fetch thread left in the frame, to AV_TIME_BASE
+// units; the stream itself may be gone by now, if the frame
+// is from the playlist item before
+static int64_t frame_time(AVFrame *frame) {
+    if (frame->best_effort_timestamp == AV_NOPTS_VALUE)
+        return AV_NOPTS_VALUE;
+    return av_rescale_q(frame->best_effort_timestamp,
+            frame->time_base, AV_TIME_BASE_Q);
+}
+
+// how far the fetch thread moved a frame along from its time
+// in the file, which pts still has
+static int64_t file_offset(Player *p, AVFrame *frame) {
+    if (frame->pts == AV_NOPTS_VALUE ||
+            frame->best_effort_timestamp == AV_NOPTS_VALUE)
+        return p->avparam.pts_offset;
+    return av_rescale_q(frame->best_effort_timestamp - frame->pts,
+            frame->time_base, AV_TIME_BASE_Q);
+}
 
-    _cleanup_(av_frame_free) AVFrame *resampled = av_frame_alloc();
-    if (!resampled) {
-        LOG_ERROR("Error allocating frame\n");
-        exit(1);
+// in push mode, queues audio with SDL, keeping only a couple of
+// device buffers' worth queued; the ring isn't used then, except
+// to tell when a seek made the audio stale
+static bool push_audio(Player *p, const uint8_t *data, int len,
+        int64_t pts, double speed, unsigned gen) {
+    App *app = &p->app;
+    AudioRing *ring = &p->audio_ring;
+    Uint32 target = AUDIO_PUSH_BUFFERS * app->audio_spec.size;
+    // SDL can't tell us when the queue drains, so sleep for as
+    // long as it takes to play down to the target; paused, it
+    // doesn't drain at all, so sleep until app_set_paused() wakes
+    // us. A seek or quit wakes us either way
+    Uint32 queued;
+    while ((queued = SDL_GetQueuedAudioSize(app->audio_devID)) > target) {
+        ASSERT(SDL_LockMutex(ring->mutex) == 0);
+        bool stale = p->avparam.done || ring->quit || ring->gen != gen;
+        if (!stale && app->paused)
+            ASSERT(SDL_CondWait(ring->space, ring->mutex) == 0);
+        else if (!stale)
+            (void)SDL_CondWaitTimeout(ring->space, ring->mutex,
+                    (queued - target) * 1000ULL /
+                    app_audio_bytes_per_sec(app) + 1);
+        ASSERT(SDL_UnlockMutex(ring->mutex) == 0);
+        if (stale)
+            return false;
     }
-#ifdef KEEP_CHANNEL_LAYOUT
-    if (av_channel_layout_copy(&resampled->ch_layout,
-                &frame->ch_layout) < 0) {
-        LOG_ERROR("Error copying channel layout\n");
-        exit(1);
+
+    SDL_LockAudioDevice(app->audio_devID);
+    bool ok = audio_ring_gen(&p->audio_ring) == gen;
+    if (ok) {
+        bool clock_started = app->pts == AV_NOPTS_VALUE;
+        // there's no callback in push mode, so the ring's
+        // underrun count is ours
+        if (!clock_started && !app->paused &&
+                SDL_GetQueuedAudioSize(app->audio_devID) == 0) {
+            ASSERT(SDL_LockMutex(p->audio_ring.mutex) == 0);
+            p->audio_ring.underruns++;
+            ASSERT(SDL_UnlockMutex(p->audio_ring.mutex) == 0);
+        }
+        ok = SDL_QueueAudio(app->audio_devID, data, len) == 0;
+        if (!ok)
+            LOG_ERROR("Error queueing audio: %s\n", SDL_GetError());
+        int64_t duration = (int64_t)((double)len * speed * AV_TIME_BASE /
+            app_audio_bytes_per_sec(app));
+        if (ok && pts != AV_NOPTS_VALUE)
+            app->pts = pts + duration;
+        else if (ok && !clock_started)
+            app->pts += duration;
+        app->pts_time = clock_now();
+        app->pts_speed = speed;
+        if (ok && clock_started && app->pts != AV_NOPTS_VALUE)
+            app_post_event(APP_EVENT_CLOCK);
     }
-#else
-    resampled->ch_layout = (AVChannelLayout) AV_CHANNEL_LAYOUT_STEREO;
-#endif
-    resampled->sample_rate = spec->freq;
-    resampled->format = AV_SAMPLE_FMT_FLT;
-    _cleanup_(swr_free) SwrContext *swr = NULL;
-    err = swr_alloc_set_opts2(&swr,
-            &resampled->ch_layout,
-            resampled->format,
-            resampled->sample_rate,
-            &frame->ch_layout,
-            frame->format,
-            frame->sample_rate,
-            0,
-            NULL
-            );
-    if (err < 0) {
-        LOG_ERROR("Error setting swresample context\n");
-        exit(1);
-    }
-    if (swr_init(swr) < 0) {
-        LOG_ERROR("Error initializing swresample context\n");
-        exit(1);
-    }
-    err = swr_convert_frame(swr, resampled, frame);
-    if (err < 0) {
-        LOG_ERROR("Error resampling frame\n");
-        exit(1);
-    }
-    return TAKE_PTR(resampled);
+    SDL_UnlockAudioDevice(app->audio_devID);
+    return ok;
 }
 
-static void audio_callback(void *ptr, uint8_t *stream, int len) {
-    App *app = (App *)ptr;
-    static uint8_t buffer[MAX_BUFFER_SIZE];
-    static int buf_idx = 0;
-    static int buf_size = 0;
-
-    int out_idx = 0;
-    if (buf_idx < buf_size) {
-        int buf_len = buf_size - buf_idx;
-        int nwrite = min(len, buf_len);
-        memcpy(stream, &buffer[buf_idx], nwrite);
-        buf_idx += nwrite;
-        if (buf_idx == buf_size) {
-            buf_idx = 0;
-            buf_size = 0;
+// applies the volume and sends a frame on to the device
+static void write_audio(Player *p, AVFrame *frame, int64_t pts,
+        double speed, unsigned gen) {
+    App *app = &p->app;
+    if (!audio_apply_gain(&p->audio_conv, frame,
+                app->muted ? 0 : app->volume))
+        return;
+    int len = frame->nb_samples * app->audio_spec.channels *
+        SDL_AUDIO_BITSIZE(app->audio_spec.format) / 8;
+    if (app->audio_push)
+        (void)push_audio(p, frame->data[0], len, pts, speed, gen);
+    else
+        (void)audio_ring_write(&p->audio_ring, frame->data[0], len,
+                pts, speed, gen);
+}
+
+// converts audio to the device format, stretches it when playing
+// at another speed and applies the volume, so the callback has
+// nothing left to do but copy it out
+static int convert_audio(void *ptr) {
+    Player *p = ptr;
+    unsigned tempo_gen = 0;
+    while (true) {
+        ASSERT(SDL_LockMutex(p->audio_queue.mutex) == 0);
+        while (p->audio_queue.count == 0 && !p->avparam.done)
+            ASSERT(SDL_CondWait(p->audio_queue.fill,
+                        p->audio_queue.mutex) == 0);
+        if (p->avparam.done) {
+            ASSERT(SDL_UnlockMutex(p->audio_queue.mutex) == 0);
+            break;
         }
-        len -= nwrite;
-        out_idx += nwrite;
-    }
+        AVFrame *frame = queue_dequeue(&p->audio_queue);
+        ASSERT(SDL_CondSignal(p->audio_queue.empty) == 0);
+        // see seek() in decode.c for why this is read
+        // with the queue locked
+        unsigned gen = audio_ring_gen(&p->audio_ring);
+        ASSERT(SDL_UnlockMutex(p->audio_queue.mutex) == 0);
 
-    while (len > 0) {
-        ASSERT(SDL_LockMutex(audio_queue.mutex) == 0);
-        if (audio_queue.count == 0) {
-            ASSERT(SDL_UnlockMutex(audio_queue.mutex) == 0);
-            memset(&stream[out_idx], 0, len);
-            return;
+        int64_t pts = frame_time(frame);
+        _cleanup_(av_frame_free) AVFrame *out =
+            audio_convert(&p->audio_conv, frame);
+        if (!out)
+            continue;
+
+        // what atempo holds on to is stale after a seek
+        if (gen != tempo_gen) {
+            audio_tempo_reset(&p->audio_tempo);
+            tempo_gen = gen;
         }
-        _cleanup_(av_frame_free) AVFrame *frame = NULL;
-        frame = queue_dequeue(&audio_queue);
-        ASSERT(SDL_CondSignal(audio_queue.empty) == 0);
-        ASSERT(SDL_UnlockMutex(audio_queue.mutex) == 0);
-        app->pts = frame->best_effort_timestamp;
-
-        _cleanup_(av_frame_free) AVFrame *resampled = NULL;
-        resampled = resample_frame(&app->audio_spec, frame);
-        int sample_size = av_get_bytes_per_sample(resampled->format);
-        int datasize = resampled->ch_layout.nb_channels *
-            resampled->nb_samples * sample_size;
-        // we are scaling the audio as we receive it from the queue
-        // we could instead scale it right before we send it to hw
-        // theoretically, that'd improve the latency of volume ctrl
-        // but it's too minuscule to bother caring about
-        float volume = app->muted ? 0 : app->volume;
-        for (int i = 0; i < datasize / sample_size; i++) {
-            ((float*)resampled->data[0])[i] *= volume;
+        double speed = p->avparam.speed;
+        if (speed == 1.0) {
+            audio_tempo_reset(&p->audio_tempo);
+            write_audio(p, out, pts, speed, gen);
+            continue;
         }
-        int nwrite = min(len, datasize);
-        memcpy(&stream[out_idx], resampled->data[0], nwrite);
-        len -= nwrite;
-        out_idx += nwrite;
-        if (nwrite < datasize) {
-            buf_size = datasize - nwrite;
-            memcpy(buffer, &resampled->data[0][nwrite], buf_size);
+        if (!audio_tempo_send(&p->audio_tempo, &p->audio_conv,
+                    TAKE_PTR(out), pts, speed))
+            continue;
+        AVFrame *stretched;
+        while ((stretched = audio_tempo_receive(&p->audio_tempo, &pts))) {
+            write_audio(p, stretched, pts, speed, gen);
+            av_frame_free(&stretched);
         }
     }
+    audio_tempo_reset(&p->audio_tempo);
+    return 0;
+}
+
+static void audio_callback(void *ptr, uint8_t *stream, int len) {
+    Player *p = ptr;
+    App *app = &p->app;
+    int64_t now = clock_now();
+
+    // callbacks come one interval apart, each handing over a
+    // buffer that plays once the previous one is done; track
+    // that interval, skipping gaps from pauses and the like
+    if (app->audio_callback_time != AV_NOPTS_VALUE) {
+        int64_t interval = now - app->audio_callback_time;
+        if (interval < 4 * app->audio_latency)
+            app->audio_latency += (interval - app->audio_latency) / 8;
+    }
+    app->audio_callback_time = now;
+
+    double speed = 1.0;
+    int64_t pts = audio_ring_read(&p->audio_ring, stream, len,
+            app->audio_spec.silence, app_audio_bytes_per_sec(app), &speed);
+    if (pts == AV_NOPTS_VALUE)
+        return;
+    bool clock_started = app->pts == AV_NOPTS_VALUE;
+    app->pts = pts;
+    app->pts_time = now;
+    app->pts_speed = speed;
+    if (clock_started)
+        app_post_event(APP_EVENT_CLOCK);
 }
 
 static inline void update_frame(App *app) {
@@ -174,50 +250,349 @@ static inline void render_frame(App *app) {
     SDL_RenderPresent(app->ren);
 }
 
-int main(int argc, char *argv[]) {
-    _cleanup_(av_frame_free) AVFrame *frame = NULL;
-    _cleanup_(app_fini) App app = {};
+// in scrub mode, frames are shown at a fixed rate rather than
+// by their pts; returns how long (in ms) until the next is due,
+// or -1 to wait for one to arrive
+static int scrub_frame(Player *p, AVFrame **pframe) {
+    App *app = &p->app;
+    int64_t now = clock_now();
+    if (now < app->scrub_next)
+        return (app->scrub_next - now + 999) / 1000;
+    ASSERT(SDL_LockMutex(p->video_queue.mutex) == 0);
+    if (p->video_queue.count == 0) {
+        ASSERT(SDL_UnlockMutex(p->video_queue.mutex) == 0);
+        return -1;
+    }
+    av_frame_free(pframe);
+    *pframe = queue_dequeue(&p->video_queue);
+    ASSERT(SDL_CondSignal(p->video_queue.empty) == 0);
+    ASSERT(SDL_UnlockMutex(p->video_queue.mutex) == 0);
+    app->dirty = true;
+
+    int64_t interval = AV_TIME_BASE / p->avparam.scrub_rate;
+    app->scrub_next = now + interval;
+    return (interval + 999) / 1000;
+}
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s input_file\n", argv[0]);
-        exit(1);
+// steps one frame forward or backward from the one on screen;
+// returns false if the frame isn't decoded yet, so the step
+// gets tried again once it is
+static bool step_frame(Player *p, AVFrame **pframe, int dir) {
+    App *app = &p->app;
+    int64_t cur = app->frame_pts;
+    if (cur == AV_NOPTS_VALUE)
+        return true;
+    if (!p->avparam.stepping) {
+        // stepping goes on without audio, starting from the GOP
+        // around the frame on screen, so the first steps back
+        // come straight from the cache
+        frame_cache_clear(&p->step_cache);
+        p->avparam.stepping = true;
+        app_seek(app, cur, AVSEEK_FLAG_BACKWARD, SEEK_GOP);
     }
 
-    atexit(main_exit_handler);
+    AVFrame *frame = dir > 0
+        ? frame_cache_next(&p->step_cache, cur)
+        : frame_cache_prev(&p->step_cache, cur);
+    if (!frame && dir < 0) {
+        // the cache starts here, so decode the GOP before
+        app_seek(app, cur, AVSEEK_FLAG_BACKWARD, SEEK_GOP);
+        frame = frame_cache_prev(&p->step_cache, cur);
+        if (!frame)
+            return true;
+    }
+    if (!frame) {
+        // past the end of the cache, the queue has what comes
+        // next, after whatever is already behind us
+        ASSERT(SDL_LockMutex(p->video_queue.mutex) == 0);
+        while (!frame && p->video_queue.count > 0) {
+            frame = queue_dequeue(&p->video_queue);
+            int64_t pts = frame_time(frame);
+            if (pts != AV_NOPTS_VALUE && pts <= cur)
+                av_frame_free(&frame);
+        }
+        ASSERT(SDL_CondSignal(p->video_queue.empty) == 0);
+        ASSERT(SDL_UnlockMutex(p->video_queue.mutex) == 0);
+        if (!frame)
+            return false;
+        int64_t pts = frame_time(frame);
+        AVFrame *ref = av_frame_clone(frame);
+        if (ref && pts != AV_NOPTS_VALUE)
+            frame_cache_add(&p->step_cache, ref, pts, pts);
+        else
+            av_frame_free(&ref);
+    }
+    av_frame_free(pframe);
+    *pframe = frame;
+    app->dirty = true;
+    return true;
+}
 
-    if (!avparam_init(&avparam, argv[1]))
-        exit(1);
+// while paused, shows the frame a seek landed on
+static void show_due_frame(Player *p, AVFrame **pframe) {
+    App *app = &p->app;
+    ASSERT(SDL_LockMutex(p->video_queue.mutex) == 0);
+    if (p->video_queue.count > 0) {
+        av_frame_free(pframe);
+        *pframe = queue_dequeue(&p->video_queue);
+        ASSERT(SDL_CondSignal(p->video_queue.empty) == 0);
+        app->frame_due = false;
+        app->dirty = true;
+    }
+    ASSERT(SDL_UnlockMutex(p->video_queue.mutex) == 0);
+}
 
-    if (!queue_init(&video_queue , "video_cnt") ||
-            !queue_init(&audio_queue , "audio_cnt")) {
-        LOG_ERROR("Error initializing frame queue\n");
-        exit(1);
+// puts what the main thread knows in the stats, in one go, so
+// they all come from the same frame
+static void publish_stats(Player *p) {
+    App *app = &p->app;
+    PlayerStats *stats = &p->stats;
+    ASSERT(SDL_LockMutex(p->stats_mutex) == 0);
+    stats->position = app->frame_pts;
+    stats->paused = app->paused;
+    stats->speed = p->avparam.speed;
+    stats->frames_shown = app->jitter.count;
+    stats->frames_dropped = app->dropped;
+    stats->av_offset = app->av_offset;
+    stats->seeks = app->seeks;
+    stats->seek_latency = app->seek_latency;
+    stats->seek_latency_max = app->seeks > 0
+        ? app->seek_latency_max : AV_NOPTS_VALUE;
+    ASSERT(SDL_UnlockMutex(p->stats_mutex) == 0);
+}
+
+// shows whatever is due, and returns how long (in ms) the main
+// loop can sleep before something else is due, or -1 if it can
+// sleep until the next event
+static int present(Player *p) {
+    App *app = &p->app;
+    AVFrame **pframe = &p->frame;
+    int timeout = -1;
+    bool new_frame = false;
+    AVFrame *shown = *pframe;
+    if (app->seek_time != AV_NOPTS_VALUE) {
+        ASSERT(SDL_LockMutex(p->avparam.seek_mtx) == 0);
+        bool eof = p->avparam.seek_eof;
+        p->avparam.seek_eof = false;
+        ASSERT(SDL_UnlockMutex(p->avparam.seek_mtx) == 0);
+        // a seek past the last frame has none to show, so it's
+        // over once the fetch thread runs out of input
+        if (eof) {
+            app->seek_time = AV_NOPTS_VALUE;
+            if (p->control)
+                control_seek_done(p->control, true);
+        }
+    }
+    if (app->step && step_frame(p, pframe, app->step))
+        app->step = 0;
+    else if (app->paused && app->frame_due)
+        show_due_frame(p, pframe);
+    if (p->avparam.scrub && !app->paused)
+        timeout = scrub_frame(p, pframe);
+    while (!app->paused && !p->avparam.scrub) {
+        int64_t clock = app_clock(app);
+        ASSERT(SDL_LockMutex(p->video_queue.mutex) == 0);
+        // with an empty queue, or before the audio clock starts,
+        // the fetch thread or the audio callback wakes us up
+        if (p->video_queue.count == 0 || clock == AV_NOPTS_VALUE) {
+            ASSERT(SDL_UnlockMutex(p->video_queue.mutex) == 0);
+            break;
+        }
+        // presenting blocks until the next vblank, so a frame
+        // due within half a refresh interval is best shown now;
+        // the clock runs at pts_speed, so the wait is in real
+        // time only once divided by that
+        int64_t pts = frame_time(queue_peek(&p->video_queue));
+        int64_t delay = pts == AV_NOPTS_VALUE ? 0
+            : (int64_t)((pts - clock) / app->pts_speed) -
+                app->vsync_interval / 2;
+        if (delay > 0) {
+            ASSERT(SDL_UnlockMutex(p->video_queue.mutex) == 0);
+            // round up, so we wake inside the window
+            // instead of spinning just short of it
+            timeout = (delay + 999) / 1000;
+            break;
+        }
+        // if we're running late, only the last of the due
+        // frames gets rescaled and shown
+        if (new_frame)
+            app->dropped++;
+        av_frame_free(pframe);
+        *pframe = queue_dequeue(&p->video_queue);
+        ASSERT(SDL_CondSignal(p->video_queue.empty) == 0);
+        ASSERT(SDL_UnlockMutex(p->video_queue.mutex) == 0);
+        app->dirty = true;
+        new_frame = true;
     }
 
-    fetch_thread = SDL_CreateThread(
-            fetch_frames, "fetch_thread", NULL);
-    if (!fetch_thread) {
-        LOG_ERROR("Error launching inferior thread\n");
-        exit(1);
+    if (app->dirty && *pframe) {
+        // nothing more can be shown after this, so give up
+        if (!update_aspect(app, *pframe) ||
+                !rescale_frame(app, *pframe)) {
+            p->avparam.done = true;
+            return -1;
+        }
+        update_frame(app);
+#ifdef PLAYER_DISP_MVS
+        draw_motion_vectors(*pframe, app->ren, &app->viewport);
+#endif
+        render_frame(app);
+        app->dirty = false;
+
+        // at other speeds, frames are due at pts / speed
+        // in real time
+        int64_t pts = frame_time(*pframe);
+        app->frame_pts = pts;
+        app->frame_offset = file_offset(p, *pframe);
+        if (new_frame && pts != AV_NOPTS_VALUE)
+            jitter_update(&app->jitter, clock_now(),
+                    pts / app->pts_speed);
+        if (new_frame) {
+            int64_t clock = app_clock(app);
+            app->av_offset = pts == AV_NOPTS_VALUE ||
+                clock == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : pts - clock;
+        }
+        // the queue only has frames from after the last seek,
+        // so a frame that wasn't on screen before is one of them
+        if (*pframe != shown && app->seek_time != AV_NOPTS_VALUE) {
+            app->seek_latency = clock_now() - app->seek_time;
+            app->seek_latency_max = max(app->seek_latency_max,
+                    app->seek_latency);
+            app->seek_time = AV_NOPTS_VALUE;
+            app->seeks++;
+            if (p->control)
+                control_seek_done(p->control, false);
+        }
+    }
+    publish_stats(p);
+    return timeout;
+}
+
+static inline void player_closep(Player **pp) {
+    if (*pp)
+        player_close(*pp);
+}
+
+static void queue_name(char *name, size_t size, const char *base, int n) {
+    if (n == 0)
+        snprintf(name, size, "%s", base);
+    else
+        snprintf(name, size, "%s.%d", base, n);
+}
+
+// each player's queues log to their own files
+static bool init_queues(Player *p) {
+    static SDL_atomic_t instances;
+    int n = SDL_AtomicAdd(&instances, 1);
+    char video_name[32], audio_name[32];
+    queue_name(video_name, sizeof video_name, "video_cnt", n);
+    queue_name(audio_name, sizeof audio_name, "audio_cnt", n);
+    if (!queue_init(&p->video_queue, video_name) ||
+            !queue_init(&p->audio_queue, audio_name))
+        return false;
+
+    FilterStage *stages[] = { &p->video_filter, &p->audio_filter };
+    const char *names[] = { "vf_cnt", "af_cnt" };
+    for (int i = 0; i < 2; i++) {
+        if (!filter_stage_enabled(stages[i]))
+            continue;
+        char name[32];
+        queue_name(name, sizeof name, names[i], n);
+        if (!queue_init(&stages[i]->in, name))
+            return false;
     }
+    return true;
+}
 
+static bool init_filters(Player *p, const Options *opts) {
+    if (!filter_chain_init(&p->video_filter.chain, opts->vf,
+                AVMEDIA_TYPE_VIDEO) ||
+            !filter_chain_init(&p->audio_filter.chain, opts->af,
+                AVMEDIA_TYPE_AUDIO) ||
+            !filter_chain_init(&p->step_filter, opts->vf,
+                AVMEDIA_TYPE_VIDEO))
+        return false;
+    p->video_filter.player = p->audio_filter.player = p;
+    p->video_filter.out = &p->video_queue;
+    p->audio_filter.out = &p->audio_queue;
+    return true;
+}
+
+static bool start_filter(FilterStage *stage, const char *name) {
+    if (!filter_stage_enabled(stage))
+        return true;
+    stage->thread = SDL_CreateThread(filter_frames, name, stage);
+    if (!stage->thread) {
+        LOG_ERROR("Error launching filter thread\n");
+        return false;
+    }
+    return true;
+}
+
+static void stop_filter(FilterStage *stage) {
+    if (!stage->thread)
+        return;
+    stage->player->avparam.done = true;
+    ASSERT(SDL_LockMutex(stage->in.mutex) == 0);
+    ASSERT(SDL_CondSignal(stage->in.fill) == 0);
+    ASSERT(SDL_UnlockMutex(stage->in.mutex) == 0);
+    SDL_WaitThread(stage->thread, NULL);
+    stage->thread = NULL;
+}
+
+Player *player_open(const Options *opts) {
+    _cleanup_(player_closep) Player *p = calloc(1, sizeof *p);
+    if (!p) {
+        LOG_ERROR("Error allocating player\n");
+        return NULL;
+    }
+    p->opts = *opts;
+    p->app.player = p;
+    fetch_state_init(&p->fetch);
+    p->stats_mutex = SDL_CreateMutex();
+    if (!p->stats_mutex) {
+        LOG_ERROR("Error creating mutex\n");
+        return NULL;
+    }
+
+    // like at the end of an item, inputs that fail to open get
+    // skipped, and the playlist starts from the first that opens
+    int first = 0;
+    while (!avparam_init(&p->avparam, opts->urls[first], opts)) {
+        printf("Skipping %s\n", opts->urls[first]);
+        avparam_fini(&p->avparam);
+        memset(&p->avparam, 0, sizeof p->avparam);
+        if (++first == opts->nb_urls)
+            return NULL;
+    }
+    if (first > 0)
+        printf("Playing %s\n", opts->urls[first]);
+    playlist_init(&p->playlist, opts, first);
+
+    if (!init_filters(p, opts)) {
+        LOG_ERROR("Error parsing filter description\n");
+        return NULL;
+    }
+    if (!init_queues(p)) {
+        LOG_ERROR("Error initializing frame queue\n");
+        return NULL;
+    }
+
+    // the device takes the stream's channels, rate and
+    // sample format, if it can
     SDL_AudioSpec wanted_spec = {
-        .callback = audio_callback,
-#ifdef KEEP_CHANNEL_LAYOUT
-        .channels = avparam.audio_ctx->ch_layout.nb_channels;
-#else
-        .channels = 2,
-#endif
-        .format   = AUDIO_F32,
-        .freq     = avparam.audio_ctx->sample_rate,
-        .samples  = 1024,
-        .userdata = &app,
+        .callback = opts->audio_push ? NULL : audio_callback,
+        .samples  = opts->audio_buffer,
+        .userdata = p,
     };
+    audio_wanted_spec(p->avparam.audio_ctx, &wanted_spec);
+    if (opts->downmix && wanted_spec.channels > 2)
+        wanted_spec.channels = 2;
 
-    AVRational sample_aspect = avparam.video_ctx->sample_aspect_ratio;
+    AVRational sample_aspect = p->avparam.video_ctx->sample_aspect_ratio;
     AVRational display_res = {
-        .num = avparam.video_ctx->width,
-        .den = avparam.video_ctx->height,
+        .num = p->avparam.video_ctx->width,
+        .den = p->avparam.video_ctx->height,
     };
     AVRational display_aspect_av = av_mul_q(sample_aspect, display_res);
     Rational display_aspect = {
@@ -225,43 +600,228 @@ int main(int argc, char *argv[]) {
         .den = display_aspect_av.den,
     };
 
-    if (!app_init(&app, &wanted_spec, &display_aspect)) {
-        exit(1);
+    if (!app_init(&p->app, &wanted_spec, &display_aspect))
+        return NULL;
+    if (!audio_conv_init(&p->audio_conv, &p->app.audio_spec,
+                &p->avparam.audio_ctx->ch_layout))
+        return NULL;
+    (void)dsp_set_level(dsp_best_level());
+    if (!frame_cache_init(&p->step_cache, opts->step_cache)) {
+        LOG_ERROR("Error initializing step cache\n");
+        return NULL;
+    }
+    // in loop mode, the start of the file gets recorded on the
+    // way through, so going round again needs no decoding
+    // until that runs out
+    if (!segment_init(&p->loop_head, opts->repeat_cache) ||
+            !segment_init(&p->ab_segment, opts->repeat_cache)) {
+        LOG_ERROR("Error initializing repeat cache\n");
+        return NULL;
+    }
+    p->loop_head.recording = p->avparam.loop && p->playlist.count == 1;
+    // a few device buffers is plenty to ride out scheduling
+    // hiccups, and keeps volume changes snappy
+    if (!audio_ring_init(&p->audio_ring, 3 * p->app.audio_spec.size)) {
+        LOG_ERROR("Error initializing audio ring\n");
+        return NULL;
     }
 
-    while (!avparam.done) {
-        if (!process_events(&app))
-            break;
-        if (app.paused) {
-            SDL_Delay(DEFAULT_FRAME_DELAY);
-            goto do_render;
+    // show the first frame right away, rather than waiting for
+    // the fetch thread to get going and the audio clock to start
+    p->frame = decode_first_frame(p);
+    if (p->frame) {
+        p->app.dirty = true;
+        (void)present(p);
+        p->avparam.startup.first_shown = clock_now();
+    }
+    avparam_print_startup(&p->avparam, stdout);
+    player_publish_item(p);
+    // the rest of the playlist can open while this plays
+    playlist_preopen(&p->playlist, p->avparam.loop);
+
+    // the fetch thread posts events to the main loop, so it
+    // can only start once SDL is up; the audio device stays
+    // paused until player_play()
+    p->app.paused = true;
+    if (!start_filter(&p->video_filter, "video_filter") ||
+            !start_filter(&p->audio_filter, "audio_filter"))
+        return NULL;
+    p->fetch_thread = SDL_CreateThread(
+            fetch_frames, "fetch_thread", p);
+    if (!p->fetch_thread) {
+        LOG_ERROR("Error launching inferior thread\n");
+        return NULL;
+    }
+    p->audio_thread = SDL_CreateThread(
+            convert_audio, "audio_thread", p);
+    if (!p->audio_thread) {
+        LOG_ERROR("Error launching audio thread\n");
+        return NULL;
+    }
+    if (opts->control) {
+        p->control = control_open(p, opts->control);
+        if (!p->control)
+            return NULL;
+    }
+    return TAKE_PTR(p);
+}
+
+void player_close(Player *p) {
+    // commands run on the main thread, which is here now, so
+    // nobody is left to answer them
+    if (p->control) {
+        control_close(p->control);
+        p->control = NULL;
+    }
+    if (p->fetch_thread) {
+        p->avparam.done = true;
+        fetch_wake(p);
+        SDL_WaitThread(p->fetch_thread, NULL);
+        p->fetch_thread = NULL;
+    }
+    head_fill_stop(p);
+    stop_filter(&p->video_filter);
+    stop_filter(&p->audio_filter);
+    if (p->audio_thread) {
+        p->avparam.done = true;
+        ASSERT(SDL_LockMutex(p->audio_queue.mutex) == 0);
+        ASSERT(SDL_CondSignal(p->audio_queue.fill) == 0);
+        ASSERT(SDL_UnlockMutex(p->audio_queue.mutex) == 0);
+        audio_ring_quit(&p->audio_ring);
+        SDL_WaitThread(p->audio_thread, NULL);
+        p->audio_thread = NULL;
+    }
+
+    // the device goes first, so the callback is done with
+    // the ring before that goes
+    app_fini(&p->app);
+    audio_conv_fini(&p->audio_conv);
+    audio_ring_fini(&p->audio_ring);
+    frame_cache_fini(&p->step_cache);
+    segment_fini(&p->loop_head);
+    segment_fini(&p->ab_segment);
+    playlist_fini(&p->playlist);
+    avparam_fini(&p->avparam);
+    queue_fini(&p->video_queue);
+    queue_fini(&p->audio_queue);
+    queue_fini(&p->video_filter.in);
+    queue_fini(&p->audio_filter.in);
+    filter_chain_fini(&p->video_filter.chain);
+    filter_chain_fini(&p->audio_filter.chain);
+    filter_chain_fini(&p->step_filter);
+    av_frame_free(&p->frame);
+    SDL_DestroyMutex(p->stats_mutex);
+    free(p);
+}
+
+void player_publish_item(Player *p) {
+    ASSERT(SDL_LockMutex(p->stats_mutex) == 0);
+    p->stats.duration = p->avparam.duration;
+    p->stats.startup = p->avparam.startup;
+    ASSERT(SDL_UnlockMutex(p->stats_mutex) == 0);
+}
+
+void player_play(Player *p) {
+    app_set_paused(&p->app, false);
+    publish_stats(p);
+}
+
+void player_pause(Player *p) {
+    app_set_paused(&p->app, true);
+    publish_stats(p);
+}
+
+void player_seek(Player *p, int64_t pts, bool exact) {
+    app_seek(&p->app, pts, AVSEEK_FLAG_BACKWARD,
+            exact ? SEEK_EXACT : SEEK_KEYFRAME);
+}
+
+void player_set_volume(Player *p, float volume) {
+    p->app.volume = min(max(volume, 0.0f), 1.0f);
+}
+
+bool player_done(Player *p) {
+    return p->avparam.done;
+}
+
+void player_get_stats(Player *p, PlayerStats *stats) {
+    ASSERT(SDL_LockMutex(p->stats_mutex) == 0);
+    *stats = p->stats;
+    ASSERT(SDL_UnlockMutex(p->stats_mutex) == 0);
+    stats->done = p->avparam.done;
+    ASSERT(SDL_LockMutex(p->video_queue.mutex) == 0);
+    stats->video_queued = p->video_queue.count;
+    ASSERT(SDL_UnlockMutex(p->video_queue.mutex) == 0);
+    ASSERT(SDL_LockMutex(p->audio_queue.mutex) == 0);
+    stats->audio_queued = p->audio_queue.count;
+    ASSERT(SDL_UnlockMutex(p->audio_queue.mutex) == 0);
+    ASSERT(SDL_LockMutex(p->audio_ring.mutex) == 0);
+    stats->audio_underruns = p->audio_ring.underruns;
+    ASSERT(SDL_UnlockMutex(p->audio_ring.mutex) == 0);
+}
+
+void player_print_stats(Player *p, FILE *fp) {
+    App *app = &p->app;
+    jitter_print(&app->jitter, fp);
+    fprintf(fp, "audio: %d-sample device buffer, %s, "
+            "%.1f ms output latency\n",
+            app->audio_spec.samples,
+            app->audio_push ? "push" : "callback",
+            app->audio_latency / 1000.0);
+    fprintf(fp, "video: %llu frames decoded, %llu dropped late\n",
+            (unsigned long long)p->fetch.video_decoded,
+            (unsigned long long)app->dropped);
+    if (app->seeks > 0)
+        fprintf(fp, "seek: %llu seeks, %.1f ms to the first frame "
+                "after the last one, %.1f ms at most\n",
+                (unsigned long long)app->seeks,
+                app->seek_latency / 1000.0,
+                app->seek_latency_max / 1000.0);
+    audio_print_stats(&p->audio_conv, &p->audio_tempo,
+            &p->audio_ring, fp);
+    filter_chain_print_stats(&p->video_filter.chain, "vf", fp);
+    filter_chain_print_stats(&p->audio_filter.chain, "af", fp);
+    frame_cache_print_stats(&p->step_cache, fp);
+    segment_print_stats(&p->loop_head, "loop", fp);
+    segment_print_stats(&p->ab_segment, "A-B repeat", fp);
+    playlist_print_stats(&p->playlist, fp);
+    input_print_stats(p->avparam.input, fp);
+    if (p->control)
+        control_print_stats(p->control, fp);
+}
+
+int player_present(Player *p) {
+    return p->avparam.done ? -1 : present(p);
+}
+
+bool player_run(Player **players, int count) {
+    while (true) {
+        // sleep until whichever player needs us first
+        int timeout = -1;
+        bool running = false;
+        for (int i = 0; i < count; i++) {
+            if (player_done(players[i]))
+                continue;
+            running = true;
+            int t = player_present(players[i]);
+            if (t >= 0 && (timeout < 0 || t < timeout))
+                timeout = t;
         }
+        if (!running)
+            return true;
 
-        ASSERT(SDL_LockMutex(video_queue.mutex) == 0);
-        if (video_queue.count == 0) {
-            ASSERT(SDL_UnlockMutex(video_queue.mutex) == 0);
-            SDL_Delay(DEFAULT_FRAME_DELAY);
-            goto do_render;
+        SDL_Event e;
+        // sleep until the first event arrives or the timeout (in
+        // ms, negative meaning forever) expires, then drain the rest
+        int got = timeout < 0
+            ? SDL_WaitEvent(&e)
+            : SDL_WaitEventTimeout(&e, timeout);
+        for (; got; got = SDL_PollEvent(&e)) {
+            for (int i = 0; i < count; i++) {
+                if (!player_done(players[i]) &&
+                        !app_handle_event(&players[i]->app, &e))
+                    return false;
+            }
         }
-        av_frame_free(&frame);
-        frame = queue_dequeue(&video_queue);
-        ASSERT(SDL_CondSignal(video_queue.empty) == 0);
-        ASSERT(SDL_UnlockMutex(video_queue.mutex) == 0);
-        rescale_frame(&app, frame);
-
-        while (app.pts < 0)
-            ;
-        long pts = frame->best_effort_timestamp;
-        unsigned delay = max(pts - app.pts, 0);
-        SDL_Delay(delay);
-
-do_render:
-        update_frame(&app);
-#ifdef PLAYER_DISP_MVS
-        draw_motion_vectors(frame, app.ren, &app.viewport);
-#endif
-        render_frame(&app);
     }
-
-    return 0;
 }
@@ -0,0 +1,106 @@
+#pragma once
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "app.h"
+#include "audio.h"
+#include "cache.h"
+#include "decode.h"
+#include "filter.h"
+#include "opts.h"
+#include "param.h"
+#include "playlist.h"
+#include "queue.h"
+
+typedef struct Control Control;
+
+// a snapshot of where a player is at, for harnesses to poll;
+// player_get_stats() can be called from any thread
+typedef struct {
+    int64_t position;   // pts of the frame on screen, or AV_NOPTS_VALUE
+    int64_t duration;   // of the current item, or AV_NOPTS_VALUE
+    bool paused;
+    bool done;
+    double speed;
+    int video_queued;
+    int audio_queued;
+    int64_t frames_decoded;
+    int64_t frames_shown;
+    int64_t frames_dropped; // being late
+    // how far ahead of the clock (in us) the last frame shown
+    // was, negative if it was late, or AV_NOPTS_VALUE
+    int64_t av_offset;
+    int64_t seeks;
+    // from asking for the last seek to the first frame shown
+    // after it, and the longest yet, in us, or AV_NOPTS_VALUE
+    int64_t seek_latency;
+    int64_t seek_latency_max;
+    int64_t audio_underruns;
+    startup_t startup;
+} PlayerStats;
+
+// everything one player instance has going: its inputs, the
+// fetch and audio threads and what they share, and the window
+// and audio device. Several can run in one process, each
+// with its own window
+struct Player {
+    Options opts;
+    avparam_t avparam;
+    Playlist playlist;
+    Queue video_queue;
+    Queue audio_queue;
+    AudioRing audio_ring;
+    AudioConv audio_conv;
+    AudioTempo audio_tempo;
+    FrameCache step_cache;
+    Segment loop_head;
+    HeadFill head_fill;
+    Segment ab_segment;
+    FetchState fetch;
+    // the --vf/--af stages between the fetch thread and the
+    // queues, when they're given
+    FilterStage video_filter;
+    FilterStage audio_filter;
+    // a copy of the --vf chain for the frames the fetch thread
+    // puts in the step cache, as the stage's is busy on its thread
+    FilterChain step_filter;
+    App app;
+    // the --control socket, if there is one
+    Control *control;
+    // what player_get_stats() hands out, which each thread puts
+    // its own numbers in: present() what's on screen, the fetch
+    // thread what it decodes
+    SDL_mutex *stats_mutex;
+    PlayerStats stats;
+
+    // the frame on screen
+    AVFrame *frame;
+    SDL_Thread *fetch_thread;
+    SDL_Thread *audio_thread;
+};
+
+// opens the inputs and the window, and shows the first frame;
+// the player starts out paused. Returns NULL on error
+Player *player_open(const Options *opts);
+void player_close(Player *p);
+void player_play(Player *p);
+void player_pause(Player *p);
+// seeks to pts (in AV_TIME_BASE units); exact seeks drop what
+// decodes before pts, rather than starting at the keyframe
+void player_seek(Player *p, int64_t pts, bool exact);
+// from 0 (silent) to 1 (as decoded)
+void player_set_volume(Player *p, float volume);
+bool player_done(Player *p);
+void player_get_stats(Player *p, PlayerStats *stats);
+// puts the item playing's duration and startup times in the
+// stats; for the fetch thread, as it moves on to the next
+void player_publish_item(Player *p);
+void player_print_stats(Player *p, FILE *fp);
+
+// shows whatever is due, and returns how long (in ms) until
+// something else is, or -1 if nothing is until the next event
+int player_present(Player *p);
+// runs the players until they're all done, or one fails;
+// events go to every player, which only takes its own
+bool player_run(Player **players, int count);
@@ -0,0 +1,97 @@
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <string.h>
+#include "clock.h"
+#include "macro.h"
+#include "playlist.h"
+
+void playlist_init(Playlist *pl, const Options *opts, int current) {
+    memset(pl, 0, sizeof *pl);
+    pl->urls = opts->urls;
+    pl->count = opts->nb_urls;
+    pl->current = current;
+    pl->opts = *opts;
+    pl->next_index = -1;
+}
+
+static int open_thread(void *ptr) {
+    Playlist *pl = ptr;
+    pl->next_ok = avparam_open(&pl->next,
+            pl->urls[pl->next_index], &pl->opts);
+    return 0;
+}
+
+// waits for the open in flight, if any
+static void join(Playlist *pl) {
+    if (pl->thread) {
+        SDL_WaitThread(pl->thread, NULL);
+        pl->thread = NULL;
+    }
+}
+
+// drops whatever was opened ahead, and starts on index
+static void start(Playlist *pl, int index) {
+    join(pl);
+    avparam_close(&pl->next);
+    pl->next_index = index;
+    pl->next_ok = false;
+    if (index < 0)
+        return;
+    pl->thread = SDL_CreateThread(open_thread, "open_thread", pl);
+    if (!pl->thread) {
+        // it'll just have to be done here, then
+        LOG_ERROR("Error launching open thread\n");
+        (void)open_thread(pl);
+    }
+}
+
+void playlist_fini(Playlist *pl) {
+    start(pl, -1);
+}
+
+// the item after index, going round again in loop mode;
+// -1 at the end
+static int following(Playlist *pl, int index, bool loop) {
+    if (index + 1 < pl->count)
+        return index + 1;
+    return loop && pl->count > 1 ? 0 : -1;
+}
+
+void playlist_preopen(Playlist *pl, bool loop) {
+    int index = following(pl, pl->current, loop);
+    if (index != pl->next_index)
+        start(pl, index);
+}
+
+// switches param over to the next item, once it's open; items
+// that fail to open get skipped. Returns false at the end
+bool playlist_advance(Playlist *pl, avparam_t *param, bool loop) {
+    int64_t start_time = clock_now();
+    // loop mode may have been turned on or off since
+    playlist_preopen(pl, loop);
+    for (int tries = 0; pl->next_index >= 0 && tries < pl->count;
+            tries++) {
+        join(pl);
+        pl->current = pl->next_index;
+        if (pl->next_ok) {
+            avparam_switch(param, &pl->next);
+            pl->next_index = -1;
+            pl->switches++;
+            pl->wait_time += clock_now() - start_time;
+            printf("Playing %s\n", pl->urls[pl->current]);
+            avparam_print_startup(param, stdout);
+            playlist_preopen(pl, loop);
+            return true;
+        }
+        start(pl, following(pl, pl->current, loop));
+    }
+    return false;
+}
+
+void playlist_print_stats(Playlist *pl, FILE *fp) {
+    if (pl->switches == 0)
+        return;
+    fprintf(fp, "playlist: %d switches, %.1f ms waiting "
+            "for the next item\n", pl->switches,
+            pl->wait_time / 1000.0);
+}
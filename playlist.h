@@ -0,0 +1,34 @@
+#pragma once
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "opts.h"
+#include "param.h"
+
+// the inputs to play one after the other; the one after the
+// current item gets opened on a background thread while this
+// one plays, so moving on at EOF is just a matter of swapping
+// the decoders over
+typedef struct {
+    char **urls;
+    int count;
+    int current;
+    Options opts;
+
+    // the item opening ahead, or -1, and whether that worked
+    avparam_t next;
+    int next_index;
+    bool next_ok;
+    SDL_Thread *thread;
+
+    int switches;
+    int64_t wait_time;  // spent at EOF waiting for the next item
+} Playlist;
+
+// current is the item already open, which playback starts with
+void playlist_init(Playlist *pl, const Options *opts, int current);
+void playlist_fini(Playlist *pl);
+void playlist_preopen(Playlist *pl, bool loop);
+bool playlist_advance(Playlist *pl, avparam_t *param, bool loop);
+void playlist_print_stats(Playlist *pl, FILE *fp);
@@ -28,7 +28,8 @@ void queue_fini(Queue *queue) {
     SDL_DestroyMutex(queue->mutex);
     queue_flush(queue);
 #ifdef QUEUE_LOG_COUNT
-    fclose(queue->fp);
+    if (queue->fp)
+        fclose(queue->fp);
 #endif
 }
 
@@ -37,7 +38,8 @@ void queue_enqueue(Queue *queue, AVFrame *frame) {
     queue->fill_ptr = (queue->fill_ptr + 1) % QUEUE_MAX;
     queue->count++;
 #ifdef QUEUE_LOG_COUNT
-    fprintf(queue->fp, "%d\n", queue->count);
+    if (queue->fp)
+        fprintf(queue->fp, "%d\n", queue->count);
 #endif
 }
 
@@ -46,11 +48,16 @@ AVFrame *queue_dequeue(Queue *queue) {
     queue->use_ptr = (queue->use_ptr + 1) % QUEUE_MAX;
     queue->count--;
 #ifdef QUEUE_LOG_COUNT
-    fprintf(queue->fp, "%d\n", queue->count);
+    if (queue->fp)
+        fprintf(queue->fp, "%d\n", queue->count);
 #endif
     return frame;
 }
 
+AVFrame *queue_peek(Queue *queue) {
+    return queue->buffer[queue->use_ptr];
+}
+
 void queue_flush(Queue *queue) {
     for (int i = queue->use_ptr; i != queue->fill_ptr; i = (i + 1) % QUEUE_MAX) {
         av_frame_free(&queue->buffer[i]);
@@ -58,6 +65,7 @@ void queue_flush(Queue *queue) {
     queue->use_ptr = queue->fill_ptr;
     queue->count = 0;
 #ifdef QUEUE_LOG_COUNT
-    fprintf(queue->fp, "%d\n", queue->count);
+    if (queue->fp)
+        fprintf(queue->fp, "%d\n", queue->count);
 #endif
 }
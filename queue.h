@@ -27,4 +27,5 @@ bool queue_init(Queue *queue, const char *name);
 void queue_fini(Queue *queue);
 void queue_enqueue(Queue *queue, AVFrame *frame);
 AVFrame *queue_dequeue(Queue *queue);
+AVFrame *queue_peek(Queue *queue);
 void queue_flush(Queue *queue);
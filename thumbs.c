@@ -0,0 +1,328 @@
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+#include <libavutil/avutil.h>
+#include <SDL2/SDL.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "clock.h"
+#include "macro.h"
+#include "opts.h"
+#include "thumbs.h"
+
+// thumbnails are this wide, and as high as their shape says,
+// with a few pixels between them
+#define THUMB_WIDTH 320
+#define THUMB_PAD 4
+
+static inline void fclosep(FILE **pfp) {
+    if (*pfp)
+        fclose(*pfp);
+}
+
+// opens the input and its video decoder, which only decodes
+// keyframes; nothing else in the file is of any use
+static bool worker_open(ThumbsWorker *w, const char *url) {
+    int64_t start = clock_now();
+    int err = avformat_open_input(&w->avctx, url, NULL, NULL);
+    if (err < 0) {
+        fprintf(stderr, "Error opening file '%s': %s\n", url,
+                av_err2str(err));
+        return false;
+    }
+    err = avformat_find_stream_info(w->avctx, NULL);
+    if (err < 0) {
+        LOG_ERROR("Error getting stream info: %s\n", av_err2str(err));
+        return false;
+    }
+
+    const AVCodec *codec = NULL;
+    w->video_si = av_find_best_stream(
+            w->avctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (w->video_si < 0) {
+        LOG_ERROR("No video stream available\n");
+        return false;
+    }
+    w->video_ctx = avcodec_alloc_context3(codec);
+    if (!w->video_ctx) {
+        LOG_ERROR("Error allocating codec context\n");
+        return false;
+    }
+    err = avcodec_parameters_to_context(w->video_ctx,
+            w->avctx->streams[w->video_si]->codecpar);
+    if (err < 0) {
+        LOG_ERROR("Error copying codec context: %s\n", av_err2str(err));
+        return false;
+    }
+    // the workers are all the parallelism there is
+    w->video_ctx->thread_count = 1;
+    w->video_ctx->skip_frame = AVDISCARD_NONKEY;
+    err = avcodec_open2(w->video_ctx, codec, NULL);
+    if (err < 0) {
+        LOG_ERROR("Error opening codec context: %s\n", av_err2str(err));
+        return false;
+    }
+    for (unsigned i = 0; i < w->avctx->nb_streams; i++)
+        w->avctx->streams[i]->discard = (int)i == w->video_si
+            ? AVDISCARD_NONKEY : AVDISCARD_ALL;
+    w->open_time = clock_now() - start;
+    return true;
+}
+
+static void worker_close(ThumbsWorker *w) {
+    avcodec_free_context(&w->video_ctx);
+    avformat_close_input(&w->avctx);
+    sws_freeContext(w->sws);
+    w->sws = NULL;
+}
+
+// decodes the keyframe a seek to pts (in AV_TIME_BASE units)
+// lands on, as seek() and read_frame() in decode.c would
+static int decode_at(ThumbsWorker *w, int64_t pts, AVFrame *frame) {
+    int err = av_seek_frame(w->avctx, -1, pts, AVSEEK_FLAG_BACKWARD);
+    if (err < 0)
+        return err;
+    avcodec_flush_buffers(w->video_ctx);
+
+    _cleanup_(av_packet_free) AVPacket *pkt = av_packet_alloc();
+    if (!pkt)
+        return AVERROR(ENOMEM);
+    while ((err = avcodec_receive_frame(w->video_ctx, frame)) ==
+            AVERROR(EAGAIN)) {
+        av_packet_unref(pkt);
+        err = av_read_frame(w->avctx, pkt);
+        if (err == AVERROR_EOF)
+            // the decoder may still be holding on to one
+            err = avcodec_send_packet(w->video_ctx, NULL);
+        else if (err >= 0 && pkt->stream_index == w->video_si)
+            err = avcodec_send_packet(w->video_ctx, pkt);
+        if (err < 0 && err != AVERROR_EOF)
+            return err;
+    }
+    return err;
+}
+
+// scales a frame straight into its cell on the sheet; the
+// cells don't overlap, so the workers needn't lock anything
+static bool place(ThumbsWorker *w, int index, AVFrame *frame) {
+    ContactSheet *sheet = w->sheet;
+    w->sws = sws_getCachedContext(w->sws,
+            frame->width, frame->height, frame->format,
+            sheet->thumb_w, sheet->thumb_h, AV_PIX_FMT_RGB24,
+            SWS_BILINEAR, NULL, NULL, NULL);
+    if (!w->sws) {
+        LOG_ERROR("Error getting swscale context\n");
+        return false;
+    }
+
+    AVFrame *image = sheet->image;
+    int x = THUMB_PAD + index % sheet->cols * (sheet->thumb_w + THUMB_PAD);
+    int y = THUMB_PAD + index / sheet->cols * (sheet->thumb_h + THUMB_PAD);
+    uint8_t *pixels[1] = {
+        image->data[0] + y * image->linesize[0] + x * 3,
+    };
+    int pitch[1] = { image->linesize[0] };
+    int ret = sws_scale(
+            w->sws, (const uint8_t * const *)frame->data,
+            frame->linesize, 0, frame->height, pixels, pitch);
+    if (ret != sheet->thumb_h) {
+        LOG_ERROR("Error scaling frame\n");
+        return false;
+    }
+    return true;
+}
+
+static int worker_main(void *ptr) {
+    ThumbsWorker *w = ptr;
+    ContactSheet *sheet = w->sheet;
+    // the first worker's input is opened already
+    if (!w->avctx && !worker_open(w, sheet->url))
+        return 0;
+
+    int64_t start = clock_now();
+    for (int i = w->first; i < w->last; i++) {
+        _cleanup_(av_frame_free) AVFrame *frame = av_frame_alloc();
+        if (!frame) {
+            LOG_ERROR("Error allocating frame\n");
+            break;
+        }
+        // each thumbnail is from the middle of its
+        // share of the timeline
+        int64_t pts = sheet->start +
+            (2 * i + 1) * sheet->duration / (2 * sheet->count);
+        int err = decode_at(w, pts, frame);
+        if (err < 0) {
+            LOG_ERROR("Error decoding thumbnail %d: %s\n", i,
+                    av_err2str(err));
+            continue;
+        }
+        if (place(w, i, frame))
+            w->extracted++;
+    }
+    w->decode_time = clock_now() - start;
+    return 0;
+}
+
+static bool write_png(AVFrame *image, const char *path) {
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_PNG);
+    if (!codec) {
+        LOG_ERROR("Failed to find encoder: png\n");
+        return false;
+    }
+    _cleanup_(avcodec_free_context) AVCodecContext *ctx =
+        avcodec_alloc_context3(codec);
+    if (!ctx) {
+        LOG_ERROR("Error allocating codec context\n");
+        return false;
+    }
+    ctx->width = image->width;
+    ctx->height = image->height;
+    ctx->pix_fmt = image->format;
+    ctx->time_base = (AVRational){ 1, 1 };
+    int err = avcodec_open2(ctx, codec, NULL);
+    if (err < 0) {
+        LOG_ERROR("Error opening encoder: %s\n", av_err2str(err));
+        return false;
+    }
+
+    _cleanup_(av_packet_free) AVPacket *pkt = av_packet_alloc();
+    if (!pkt) {
+        LOG_ERROR("Error allocating packet\n");
+        return false;
+    }
+    err = avcodec_send_frame(ctx, image);
+    if (err >= 0)
+        err = avcodec_receive_packet(ctx, pkt);
+    if (err < 0) {
+        LOG_ERROR("Error encoding contact sheet: %s\n", av_err2str(err));
+        return false;
+    }
+
+    _cleanup_(fclosep) FILE *fp = fopen(path, "wb");
+    if (!fp || fwrite(pkt->data, 1, pkt->size, fp) != (size_t)pkt->size) {
+        fprintf(stderr, "Error writing '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// lays out the sheet, and fills it with the background
+static bool sheet_init(ContactSheet *sheet) {
+    ThumbsWorker *w = &sheet->workers[0];
+    AVRational sar = w->video_ctx->sample_aspect_ratio;
+    if (sar.num <= 0 || sar.den <= 0)
+        sar = (AVRational){ 1, 1 };
+    AVRational dar = av_mul_q(sar,
+            (AVRational){ w->video_ctx->width, w->video_ctx->height });
+    sheet->thumb_w = THUMB_WIDTH;
+    sheet->thumb_h = max((int)((int64_t)THUMB_WIDTH * dar.den /
+                dar.num) & ~1, 2);
+    sheet->cols = 1;
+    while (sheet->cols * sheet->cols < sheet->count)
+        sheet->cols++;
+    sheet->rows = (sheet->count + sheet->cols - 1) / sheet->cols;
+
+    sheet->image = av_frame_alloc();
+    if (!sheet->image) {
+        LOG_ERROR("Error allocating frame\n");
+        return false;
+    }
+    sheet->image->format = AV_PIX_FMT_RGB24;
+    sheet->image->width =
+        THUMB_PAD + sheet->cols * (sheet->thumb_w + THUMB_PAD);
+    sheet->image->height =
+        THUMB_PAD + sheet->rows * (sheet->thumb_h + THUMB_PAD);
+    if (av_frame_get_buffer(sheet->image, 0) < 0) {
+        LOG_ERROR("Error allocating frame buffer\n");
+        return false;
+    }
+    for (int y = 0; y < sheet->image->height; y++) {
+        uint8_t *row = sheet->image->data[0] + y * sheet->image->linesize[0];
+        for (int x = 0; x < sheet->image->width; x++) {
+            row[3 * x + 0] = 0x00;
+            row[3 * x + 1] = 0x2b;
+            row[3 * x + 2] = 0x36;
+        }
+    }
+    return true;
+}
+
+static void sheet_fini(ContactSheet *sheet) {
+    for (int i = 0; i < sheet->nb_workers; i++) {
+        if (sheet->workers[i].thread)
+            SDL_WaitThread(sheet->workers[i].thread, NULL);
+    }
+    for (int i = 0; i < THUMBS_WORKERS_MAX; i++)
+        worker_close(&sheet->workers[i]);
+    av_frame_free(&sheet->image);
+}
+
+bool thumbs_run(const Options *opts) {
+    _cleanup_(sheet_fini) ContactSheet sheet = {};
+    sheet.url = opts->urls[0];
+    sheet.count = opts->thumbnails;
+    if (opts->nb_urls > 1)
+        fprintf(stderr, "Only the first input goes on the sheet\n");
+    int64_t start = clock_now();
+
+    // the first worker's input tells us how long the
+    // timeline is, and the shape of the thumbnails
+    ThumbsWorker *first = &sheet.workers[0];
+    first->sheet = &sheet;
+    if (!worker_open(first, sheet.url))
+        return false;
+    AVFormatContext *avctx = first->avctx;
+    if (avctx->pb && !(avctx->pb->seekable & AVIO_SEEKABLE_NORMAL)) {
+        fprintf(stderr, "Input is not seekable\n");
+        return false;
+    }
+    if (avctx->duration == AV_NOPTS_VALUE || avctx->duration <= 0) {
+        fprintf(stderr, "Input has no known duration\n");
+        return false;
+    }
+    sheet.start = avctx->start_time == AV_NOPTS_VALUE
+        ? 0 : avctx->start_time;
+    sheet.duration = avctx->duration;
+    if (!sheet_init(&sheet))
+        return false;
+
+    // each worker gets a stretch of the timeline, so its
+    // seeks only ever go forward
+    sheet.nb_workers = min(max(SDL_GetCPUCount(), 1),
+            min(sheet.count, THUMBS_WORKERS_MAX));
+    for (int i = 0; i < sheet.nb_workers; i++) {
+        ThumbsWorker *w = &sheet.workers[i];
+        w->sheet = &sheet;
+        w->first = i * sheet.count / sheet.nb_workers;
+        w->last = (i + 1) * sheet.count / sheet.nb_workers;
+        w->thread = SDL_CreateThread(worker_main, "thumbs_worker", w);
+        if (!w->thread) {
+            LOG_ERROR("Error launching thumbnail worker\n");
+            return false;
+        }
+    }
+
+    int extracted = 0;
+    int64_t open_time = 0, decode_time = 0;
+    for (int i = 0; i < sheet.nb_workers; i++) {
+        ThumbsWorker *w = &sheet.workers[i];
+        SDL_WaitThread(w->thread, NULL);
+        w->thread = NULL;
+        extracted += w->extracted;
+        open_time += w->open_time;
+        decode_time += w->decode_time;
+    }
+    if (!write_png(sheet.image, opts->contact_sheet))
+        return false;
+
+    printf("contact sheet: %d of %d thumbnails by %d workers in %.1f ms "
+            "(%.1f ms opening, %.1f ms decoding per worker), "
+            "written to %s\n",
+            extracted, sheet.count, sheet.nb_workers,
+            (clock_now() - start) / 1000.0,
+            open_time / 1000.0 / sheet.nb_workers,
+            decode_time / 1000.0 / sheet.nb_workers,
+            opts->contact_sheet);
+    return extracted > 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "opts.h"
+
+#define THUMBS_WORKERS_MAX 64
+
+typedef struct AVCodecContext AVCodecContext;
+typedef struct AVFormatContext AVFormatContext;
+typedef struct AVFrame AVFrame;
+struct SwsContext;
+typedef struct ContactSheet ContactSheet;
+
+// each worker has the input open for itself, and takes a
+// stretch of the timeline: thumbnails first to last - 1
+typedef struct {
+    ContactSheet *sheet;
+    AVFormatContext *avctx;
+    AVCodecContext *video_ctx;
+    int video_si;
+    struct SwsContext *sws;
+    int first, last;
+    SDL_Thread *thread;
+
+    int extracted;
+    int64_t open_time, decode_time;
+} ThumbsWorker;
+
+// keyframe thumbnails, evenly spaced over an input, laid out
+// in a grid on one image
+struct ContactSheet {
+    const char *url;
+    int count;
+    int cols, rows;
+    int thumb_w, thumb_h;
+    int64_t start, duration;
+    AVFrame *image;
+    ThumbsWorker workers[THUMBS_WORKERS_MAX];
+    int nb_workers;
+};
+
+// writes a contact sheet of opts->urls[0] to opts->contact_sheet,
+// as a PNG; returns false on error
+bool thumbs_run(const Options *opts);
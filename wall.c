@@ -0,0 +1,783 @@
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+#include <libavutil/avutil.h>
+#include <SDL2/SDL.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "app.h"
+#include "audio.h"
+#include "clock.h"
+#include "macro.h"
+#include "opts.h"
+#include "param.h"
+#include "queue.h"
+#include "wall.h"
+
+// video frames a worker decodes from a tile before it
+// gives the others a turn
+#define WALL_SLICE_FRAMES 4
+
+// a frame's timestamp in AV_TIME_BASE units, as in player.c
+static int64_t frame_time(AVFrame *frame) {
+    if (frame->best_effort_timestamp == AV_NOPTS_VALUE)
+        return AV_NOPTS_VALUE;
+    return av_rescale_q(frame->best_effort_timestamp,
+            frame->time_base, AV_TIME_BASE_Q);
+}
+
+static AVRational display_aspect(avparam_t *param) {
+    AVRational sar = param->video_ctx->sample_aspect_ratio;
+    if (sar.num <= 0 || sar.den <= 0)
+        sar = (AVRational){ 1, 1 };
+    return av_mul_q(sar, (AVRational){
+            param->video_ctx->width, param->video_ctx->height });
+}
+
+// reads the next frame from either decoder, like read_frame() in
+// decode.c; the audio of tiles nobody hears is discarded by the
+// demuxer, so there's never any of that
+static int tile_read(Tile *t, AVFrame *frame) {
+    avparam_t *param = &t->param;
+    int err = t->codec_ctx
+        ? avcodec_receive_frame(t->codec_ctx, frame)
+        : AVERROR(EAGAIN);
+    while (err == AVERROR(EAGAIN)) {
+        _cleanup_(av_packet_free) AVPacket *pkt = av_packet_alloc();
+        if (!pkt) {
+            LOG_ERROR("Error allocating packet\n");
+            return AVERROR(ENOMEM);
+        }
+
+        do {
+            av_packet_unref(pkt);
+            err = av_read_frame(param->avctx, pkt);
+            if (err == AVERROR_EOF) {
+                return err;
+            } else if (err < 0) {
+                LOG_ERROR("Error reading frame from %s: %s\n",
+                        t->url, av_err2str(err));
+                return err;
+            }
+            t->codec_ctx =
+                pkt->stream_index == param->video_si
+                ? param->video_ctx
+                : pkt->stream_index == param->audio_si
+                ? param->audio_ctx
+                : NULL;
+        } while (!t->codec_ctx);
+        t->stream_index = pkt->stream_index;
+
+        err = avcodec_send_packet(t->codec_ctx, pkt);
+        if (err < 0) {
+            LOG_ERROR("Error sending packet to decoder: %s\n",
+                    av_err2str(err));
+            return err;
+        }
+
+        err = avcodec_receive_frame(t->codec_ctx, frame);
+    }
+    if (err < 0) {
+        LOG_ERROR("Error receiving frame from decoder: %s\n",
+                av_err2str(err));
+        return err;
+    }
+
+    AVRational tb = param->avctx->streams[t->stream_index]->time_base;
+    frame->time_base = tb;
+    if (frame->best_effort_timestamp == AV_NOPTS_VALUE)
+        return 0;
+    if (t->stream_index == param->video_si) {
+        int64_t end = av_rescale_q(frame->best_effort_timestamp +
+                frame->duration, tb, AV_TIME_BASE_Q);
+        if (t->pass_end == AV_NOPTS_VALUE || end > t->pass_end)
+            t->pass_end = end;
+    }
+    // looping moves timestamps along, as in decode.c
+    frame->best_effort_timestamp +=
+        av_rescale_q(param->pts_offset, AV_TIME_BASE_Q, tb);
+    return 0;
+}
+
+// goes back to the start at EOF, with timestamps carrying on
+// from where this pass ended
+static bool rewind_tile(Tile *t) {
+    avparam_t *param = &t->param;
+    // nothing decoded this time round, so it'd never end
+    if (!param->seekable || t->pass_end == AV_NOPTS_VALUE)
+        return false;
+    int64_t start = param->avctx->start_time == AV_NOPTS_VALUE
+        ? 0 : param->avctx->start_time;
+    int err = av_seek_frame(param->avctx, -1, start,
+            AVSEEK_FLAG_BACKWARD);
+    if (err < 0) {
+        LOG_ERROR("Error seeking %s: %s\n", t->url, av_err2str(err));
+        return false;
+    }
+    avcodec_flush_buffers(param->video_ctx);
+    avcodec_flush_buffers(param->audio_ctx);
+    t->codec_ctx = NULL;
+    param->pts_offset += t->pass_end - start;
+    t->pass_end = AV_NOPTS_VALUE;
+    return true;
+}
+
+// scales a decoded frame to the tile, so the main thread only
+// has to upload it
+static AVFrame *scale_frame(Tile *t, AVFrame *frame,
+        int width, int height) {
+    t->sws = sws_getCachedContext(t->sws,
+            frame->width, frame->height, frame->format,
+            width, height, AV_PIX_FMT_RGBA,
+            SWS_BILINEAR, NULL, NULL, NULL);
+    if (!t->sws) {
+        LOG_ERROR("Error getting swscale context\n");
+        return NULL;
+    }
+
+    _cleanup_(av_frame_free) AVFrame *out = av_frame_alloc();
+    if (!out) {
+        LOG_ERROR("Error allocating frame\n");
+        return NULL;
+    }
+    out->format = AV_PIX_FMT_RGBA;
+    out->width = width;
+    out->height = height;
+    if (av_frame_get_buffer(out, 0) < 0) {
+        LOG_ERROR("Error allocating frame buffer\n");
+        return NULL;
+    }
+    (void)av_frame_copy_props(out, frame);
+    out->time_base = frame->time_base;
+
+    int ret = sws_scale(
+            t->sws, (const uint8_t * const *)frame->data,
+            frame->linesize, 0, frame->height, out->data, out->linesize);
+    if (ret != height) {
+        LOG_ERROR("Error scaling frame\n");
+        return NULL;
+    }
+    return TAKE_PTR(out);
+}
+
+static bool has_room(Queue *queue) {
+    ASSERT(SDL_LockMutex(queue->mutex) == 0);
+    bool room = queue->count < QUEUE_MAX;
+    ASSERT(SDL_UnlockMutex(queue->mutex) == 0);
+    return room;
+}
+
+// unlike put_frame() in decode.c, this never waits for room, as
+// that would hold up the worker; the caller checks beforehand
+static void tile_put(Tile *t, Queue *queue, AVFrame *frame) {
+    ASSERT(SDL_LockMutex(queue->mutex) == 0);
+    queue_enqueue(queue, frame);
+    bool first = queue->count == 1;
+    ASSERT(SDL_UnlockMutex(queue->mutex) == 0);
+    // the main loop sleeps while there is nothing to show
+    if (first && queue == &t->video_queue)
+        app_post_event(APP_EVENT_FRAME);
+}
+
+// decodes a slice of a tile, until its queues fill up or it's
+// done its share; returns whether it wants to go again
+static bool decode_slice(Wall *wall, Tile *t, int width, int height,
+        bool heard, bool late) {
+    avparam_t *param = &t->param;
+    param->video_ctx->skip_frame = late ? AVDISCARD_NONREF
+        : AVDISCARD_DEFAULT;
+    param->avctx->streams[param->audio_si]->discard = heard
+        ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    t->slices++;
+    if (late)
+        t->late_slices++;
+
+    int n = 0;
+    while (n < WALL_SLICE_FRAMES) {
+        if (!has_room(&t->video_queue) ||
+                (heard && !has_room(&t->audio_queue)))
+            return false;
+        _cleanup_(av_frame_free) AVFrame *frame = av_frame_alloc();
+        if (!frame) {
+            LOG_ERROR("Error allocating frame\n");
+            break;
+        }
+        int err = tile_read(t, frame);
+        if (err == AVERROR_EOF && wall->opts.loop && rewind_tile(t))
+            continue;
+        if (err < 0)
+            break;
+        // audio decoded just before the tile stopped being
+        // heard goes nowhere
+        if (t->stream_index == param->audio_si) {
+            if (heard)
+                tile_put(t, &t->audio_queue, TAKE_PTR(frame));
+            continue;
+        }
+        AVFrame *scaled = scale_frame(t, frame, width, height);
+        if (!scaled)
+            break;
+        t->decoded++;
+        tile_put(t, &t->video_queue, scaled);
+        n++;
+    }
+    if (n < WALL_SLICE_FRAMES) {
+        // the main loop may be waiting for this one to finish
+        ASSERT(SDL_LockMutex(wall->pool.mutex) == 0);
+        t->eof = true;
+        ASSERT(SDL_UnlockMutex(wall->pool.mutex) == 0);
+        app_post_event(APP_EVENT_DONE);
+        return false;
+    }
+    return true;
+}
+
+static void runs_push(WallRuns *runs, int index) {
+    runs->tiles[(runs->start + runs->count) % WALL_TILES_MAX] = index;
+    runs->count++;
+}
+
+static int runs_pop(WallRuns *runs) {
+    int index = runs->tiles[runs->start];
+    runs->start = (runs->start + 1) % WALL_TILES_MAX;
+    runs->count--;
+    return index;
+}
+
+// thieves take from the back, leaving the owner what it's
+// about to get to
+static int runs_steal(WallRuns *runs) {
+    runs->count--;
+    return runs->tiles[(runs->start + runs->count) % WALL_TILES_MAX];
+}
+
+// with the pool locked; returns -1 if there's nothing to do
+static int pool_take(WallPool *pool, int worker) {
+    if (pool->runs[worker].count > 0)
+        return runs_pop(&pool->runs[worker]);
+    int victim = -1;
+    for (int i = 0; i < pool->count; i++) {
+        if (pool->runs[i].count > 0 && (victim < 0 ||
+                    pool->runs[i].count > pool->runs[victim].count))
+            victim = i;
+    }
+    if (victim < 0)
+        return -1;
+    pool->steals++;
+    return runs_steal(&pool->runs[victim]);
+}
+
+// puts a tile that wants decoding on a run list, unless it's
+// on one already or being decoded
+static void pool_schedule(WallPool *pool, Tile *t, int index) {
+    ASSERT(SDL_LockMutex(pool->mutex) == 0);
+    if (!t->scheduled && !t->eof) {
+        t->scheduled = true;
+        runs_push(&pool->runs[t->worker], index);
+        ASSERT(SDL_CondSignal(pool->work) == 0);
+    }
+    ASSERT(SDL_UnlockMutex(pool->mutex) == 0);
+}
+
+static int worker_main(void *ptr) {
+    WallWorker *worker = ptr;
+    Wall *wall = worker->wall;
+    WallPool *pool = &wall->pool;
+
+    ASSERT(SDL_LockMutex(pool->mutex) == 0);
+    while (!pool->quit) {
+        int index = pool_take(pool, worker->index);
+        if (index < 0) {
+            ASSERT(SDL_CondWait(pool->work, pool->mutex) == 0);
+            continue;
+        }
+        Tile *t = &wall->tiles[index];
+        int width = t->width, height = t->height;
+        bool heard = t->heard, late = t->late;
+        ASSERT(SDL_UnlockMutex(pool->mutex) == 0);
+
+        bool again = decode_slice(wall, t, width, height, heard, late);
+
+        ASSERT(SDL_LockMutex(pool->mutex) == 0);
+        // the tile's frames are warm in this worker's cache,
+        // so it comes back here
+        t->worker = worker->index;
+        if (again) {
+            runs_push(&pool->runs[worker->index], index);
+            // with a backlog, an idle worker can take some
+            if (pool->runs[worker->index].count > 1)
+                ASSERT(SDL_CondSignal(pool->work) == 0);
+        } else {
+            t->scheduled = false;
+        }
+    }
+    ASSERT(SDL_UnlockMutex(pool->mutex) == 0);
+    return 0;
+}
+
+static int64_t wall_clock(Wall *wall) {
+    int64_t now = wall->app.paused ? wall->paused_at : clock_now();
+    return now - wall->start - wall->paused_time;
+}
+
+// lays the tiles out in a grid over the viewport, each keeping
+// its shape within its cell
+static void layout(Wall *wall) {
+    SDL_Rect *vp = &wall->app.viewport;
+    ASSERT(SDL_LockMutex(wall->pool.mutex) == 0);
+    for (int i = 0; i < wall->count; i++) {
+        Tile *t = &wall->tiles[i];
+        int col = i % wall->cols, row = i / wall->cols;
+        int x = vp->x + col * vp->w / wall->cols;
+        int y = vp->y + row * vp->h / wall->rows;
+        int cell_w = vp->x + (col + 1) * vp->w / wall->cols - x;
+        int cell_h = vp->y + (row + 1) * vp->h / wall->rows - y;
+
+        AVRational dar = display_aspect(&t->param);
+        int w = cell_w;
+        int h = (int)((int64_t)cell_w * dar.den / dar.num);
+        if (h > cell_h) {
+            h = cell_h;
+            w = (int)((int64_t)cell_h * dar.num / dar.den);
+        }
+        t->rect = (SDL_Rect){
+            x + (cell_w - w) / 2, y + (cell_h - h) / 2, w, h,
+        };
+        // what's queued already is at the old size, but that
+        // only gets stretched a bit
+        t->width = max(w & ~1, 2);
+        t->height = max(h & ~1, 2);
+    }
+    ASSERT(SDL_UnlockMutex(wall->pool.mutex) == 0);
+    wall->app.dirty = true;
+}
+
+// takes what's due off each tile's queue, and returns how long
+// (in ms) until the next frame of any tile is due, or -1 if
+// none is until a worker wakes us up
+static int take_frames(Wall *wall) {
+    int64_t clock = wall_clock(wall);
+    int timeout = -1;
+    bool done = true;
+    for (int i = 0; i < wall->count; i++) {
+        Tile *t = &wall->tiles[i];
+        // the worker queues the last frames before it sets
+        // this, so if it's set, what's queued is all there is
+        ASSERT(SDL_LockMutex(wall->pool.mutex) == 0);
+        bool eof = t->eof;
+        ASSERT(SDL_UnlockMutex(wall->pool.mutex) == 0);
+        int delay_ms = -1;
+        int got = 0;
+
+        ASSERT(SDL_LockMutex(t->video_queue.mutex) == 0);
+        while (t->video_queue.count > 0) {
+            int64_t pts = frame_time(queue_peek(&t->video_queue));
+            // each tile's clock starts with its first frame
+            if (t->base == AV_NOPTS_VALUE)
+                t->base = (pts == AV_NOPTS_VALUE ? 0 : pts) - clock;
+            int64_t delay = pts == AV_NOPTS_VALUE ? 0
+                : pts - t->base - clock;
+            if (delay > 0) {
+                delay_ms = (delay + 999) / 1000;
+                break;
+            }
+            // if a tile is running late, only the last
+            // of its due frames gets shown
+            av_frame_free(&t->frame);
+            t->frame = queue_dequeue(&t->video_queue);
+            got++;
+        }
+        bool room = t->video_queue.count < QUEUE_MAX;
+        bool empty = t->video_queue.count == 0;
+        ASSERT(SDL_UnlockMutex(t->video_queue.mutex) == 0);
+
+        if (got > 0) {
+            t->shown++;
+            t->dropped += got - 1;
+            t->dirty = true;
+            // dropping frames, the decoder may as well skip
+            // what it can
+            bool late = got > 1;
+            if (late != t->late) {
+                ASSERT(SDL_LockMutex(wall->pool.mutex) == 0);
+                t->late = late;
+                ASSERT(SDL_UnlockMutex(wall->pool.mutex) == 0);
+            }
+        }
+        if (delay_ms >= 0 && (timeout < 0 || delay_ms < timeout))
+            timeout = delay_ms;
+        if (room)
+            pool_schedule(&wall->pool, t, i);
+        if (!eof || !empty)
+            done = false;
+    }
+    if (done)
+        wall->done = true;
+    return timeout;
+}
+
+// sends the heard tile's due audio on to the device; audio is
+// due when it'd be heard as the clock gets to it, after what's
+// queued there already
+static void feed_audio(Wall *wall) {
+    App *app = &wall->app;
+    Tile *t = &wall->tiles[wall->heard];
+    if (app->paused || t->base == AV_NOPTS_VALUE)
+        return;
+    int64_t clock = wall_clock(wall);
+    int bytes_per_sec = app_audio_bytes_per_sec(app);
+    while (true) {
+        int64_t ahead = (int64_t)SDL_GetQueuedAudioSize(
+                app->audio_devID) * AV_TIME_BASE / bytes_per_sec;
+        ASSERT(SDL_LockMutex(t->audio_queue.mutex) == 0);
+        if (t->audio_queue.count == 0) {
+            ASSERT(SDL_UnlockMutex(t->audio_queue.mutex) == 0);
+            break;
+        }
+        int64_t pts = frame_time(queue_peek(&t->audio_queue));
+        if (pts != AV_NOPTS_VALUE)
+            pts -= t->base;
+        if (pts != AV_NOPTS_VALUE &&
+                pts > clock + ahead + app->audio_latency) {
+            ASSERT(SDL_UnlockMutex(t->audio_queue.mutex) == 0);
+            break;
+        }
+        AVFrame *frame = queue_dequeue(&t->audio_queue);
+        ASSERT(SDL_UnlockMutex(t->audio_queue.mutex) == 0);
+
+        // too late to be any use
+        if (pts != AV_NOPTS_VALUE && frame->sample_rate > 0 &&
+                pts + (int64_t)frame->nb_samples * AV_TIME_BASE /
+                frame->sample_rate < clock + ahead) {
+            av_frame_free(&frame);
+            continue;
+        }
+        _cleanup_(av_frame_free) AVFrame *out =
+            audio_convert(&wall->audio_conv, frame);
+        if (!out || !audio_apply_gain(&wall->audio_conv, out,
+                    app->muted ? 0 : app->volume))
+            continue;
+        int len = out->nb_samples * app->audio_spec.channels *
+            SDL_AUDIO_BITSIZE(app->audio_spec.format) / 8;
+        if (SDL_QueueAudio(app->audio_devID, out->data[0], len) < 0)
+            LOG_ERROR("Error queueing audio: %s\n", SDL_GetError());
+    }
+}
+
+// uploads the frames that changed, and redraws the wall
+// if anything did
+static bool render(Wall *wall) {
+    App *app = &wall->app;
+    bool dirty = app->dirty;
+    for (int i = 0; i < wall->count; i++) {
+        Tile *t = &wall->tiles[i];
+        AVFrame *frame = t->frame;
+        if (!t->dirty || !frame)
+            continue;
+        if (!t->tex || t->tex_w != frame->width ||
+                t->tex_h != frame->height) {
+            if (t->tex)
+                SDL_DestroyTexture(t->tex);
+            t->tex = SDL_CreateTexture(
+                    app->ren, SDL_PIXELFORMAT_RGBA32,
+                    SDL_TEXTUREACCESS_STREAMING,
+                    frame->width, frame->height);
+            if (!t->tex) {
+                LOG_ERROR("Error creating texture\n");
+                return false;
+            }
+            t->tex_w = frame->width;
+            t->tex_h = frame->height;
+        }
+        ASSERT(SDL_UpdateTexture(t->tex, NULL,
+                    frame->data[0], frame->linesize[0]) == 0);
+        t->dirty = false;
+        dirty = true;
+    }
+    if (!dirty)
+        return true;
+
+    ASSERT(SDL_SetRenderDrawColor(
+                app->ren, 0x00, 0x2b, 0x36, 0xff) == 0);
+    ASSERT(SDL_RenderClear(app->ren) == 0);
+    for (int i = 0; i < wall->count; i++) {
+        Tile *t = &wall->tiles[i];
+        if (t->tex)
+            ASSERT(SDL_RenderCopy(app->ren, t->tex, NULL, &t->rect) == 0);
+    }
+    // the tile being heard gets a frame around it
+    ASSERT(SDL_SetRenderDrawColor(
+                app->ren, 0xb5, 0x89, 0x00, 0xff) == 0);
+    ASSERT(SDL_RenderDrawRect(app->ren,
+                &wall->tiles[wall->heard].rect) == 0);
+    SDL_RenderPresent(app->ren);
+    app->dirty = false;
+    return true;
+}
+
+static void flush_audio(Tile *t) {
+    ASSERT(SDL_LockMutex(t->audio_queue.mutex) == 0);
+    queue_flush(&t->audio_queue);
+    ASSERT(SDL_UnlockMutex(t->audio_queue.mutex) == 0);
+}
+
+// switches the audio over to another tile
+static void hear(Wall *wall, int index) {
+    if (index == wall->heard)
+        return;
+    Tile *old = &wall->tiles[wall->heard];
+    Tile *t = &wall->tiles[index];
+    // whatever the new one has queued is from when it was
+    // last heard
+    flush_audio(t);
+    ASSERT(SDL_LockMutex(wall->pool.mutex) == 0);
+    old->heard = false;
+    t->heard = true;
+    ASSERT(SDL_UnlockMutex(wall->pool.mutex) == 0);
+    flush_audio(old);
+    SDL_ClearQueuedAudio(wall->app.audio_devID);
+    wall->heard = index;
+    wall->app.dirty = true;
+    printf("Audio: %s\n", t->url);
+}
+
+static void toggle_pause(Wall *wall) {
+    App *app = &wall->app;
+    int64_t now = clock_now();
+    if (app->paused)
+        wall->paused_time += now - wall->paused_at;
+    else
+        wall->paused_at = now;
+    app->paused = !app->paused;
+    SDL_PauseAudioDevice(app->audio_devID, app->paused);
+}
+
+static bool handle_event(Wall *wall, const SDL_Event *e) {
+    App *app = &wall->app;
+    switch (e->type) {
+    case SDL_QUIT:
+        wall->done = true;
+        break;
+    case SDL_KEYDOWN:
+        switch (e->key.keysym.sym) {
+        case SDLK_q:
+            wall->done = true;
+            break;
+        case SDLK_SPACE:
+            toggle_pause(wall);
+            break;
+        case SDLK_m:
+            app->muted = !app->muted;
+            break;
+        case SDLK_f:
+            app_toggle_fullscreen(app);
+            break;
+        case SDLK_9:
+            app->volume = max(app->volume - 0.05f, 0.0f);
+            break;
+        case SDLK_0:
+            app->volume = min(app->volume + 0.05f, 1.0f);
+            break;
+        case SDLK_TAB:
+            hear(wall, (wall->heard + 1) % wall->count);
+            break;
+        }
+        break;
+    case SDL_MOUSEBUTTONDOWN:
+        for (int i = 0; i < wall->count; i++) {
+            SDL_Rect *r = &wall->tiles[i].rect;
+            if (e->button.x >= r->x && e->button.x < r->x + r->w &&
+                    e->button.y >= r->y && e->button.y < r->y + r->h)
+                hear(wall, i);
+        }
+        break;
+    case SDL_WINDOWEVENT:
+        if (e->window.event == SDL_WINDOWEVENT_CLOSE)
+            wall->done = true;
+        if (e->window.event == SDL_WINDOWEVENT_EXPOSED)
+            app->dirty = true;
+        if (e->window.event == SDL_WINDOWEVENT_RESIZED) {
+            if (!app_resize(app, e->window.data1, e->window.data2))
+                return false;
+            layout(wall);
+        }
+        break;
+    default:
+        // the workers' events only wake us up
+        break;
+    }
+    return true;
+}
+
+static bool open_tiles(Wall *wall) {
+    wall->tiles = calloc(wall->count, sizeof *wall->tiles);
+    if (!wall->tiles) {
+        LOG_ERROR("Error allocating tiles\n");
+        return false;
+    }
+    // the pool is all the parallelism there is, unless
+    // asked otherwise
+    Options opts = wall->opts;
+    if (opts.decoder_threads == 0)
+        opts.decoder_threads = 1;
+    for (int i = 0; i < wall->count; i++) {
+        Tile *t = &wall->tiles[i];
+        t->url = wall->opts.urls[i];
+        t->stream_index = -1;
+        t->pass_end = AV_NOPTS_VALUE;
+        t->base = AV_NOPTS_VALUE;
+        t->worker = i % wall->pool.count;
+        if (!avparam_open(&t->param, t->url, &opts))
+            return false;
+
+        char video_name[32], audio_name[32];
+        snprintf(video_name, sizeof video_name, "video_cnt.tile%d", i);
+        snprintf(audio_name, sizeof audio_name, "audio_cnt.tile%d", i);
+        if (!queue_init(&t->video_queue, video_name) ||
+                !queue_init(&t->audio_queue, audio_name)) {
+            LOG_ERROR("Error initializing frame queue\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+static void wall_close(Wall *wall) {
+    WallPool *pool = &wall->pool;
+    if (pool->mutex) {
+        ASSERT(SDL_LockMutex(pool->mutex) == 0);
+        pool->quit = true;
+        ASSERT(SDL_CondBroadcast(pool->work) == 0);
+        ASSERT(SDL_UnlockMutex(pool->mutex) == 0);
+    }
+    for (int i = 0; i < pool->count; i++) {
+        if (pool->threads[i])
+            SDL_WaitThread(pool->threads[i], NULL);
+    }
+
+    // the textures go with the renderer
+    for (int i = 0; wall->tiles && i < wall->count; i++) {
+        if (wall->tiles[i].tex)
+            SDL_DestroyTexture(wall->tiles[i].tex);
+    }
+    app_fini(&wall->app);
+    audio_conv_fini(&wall->audio_conv);
+    for (int i = 0; wall->tiles && i < wall->count; i++) {
+        Tile *t = &wall->tiles[i];
+        avparam_close(&t->param);
+        queue_fini(&t->video_queue);
+        queue_fini(&t->audio_queue);
+        av_frame_free(&t->frame);
+        sws_freeContext(t->sws);
+    }
+    free(wall->tiles);
+    SDL_DestroyCond(pool->work);
+    SDL_DestroyMutex(pool->mutex);
+}
+
+static void print_stats(Wall *wall, FILE *fp) {
+    for (int i = 0; i < wall->count; i++) {
+        Tile *t = &wall->tiles[i];
+        fprintf(fp, "tile %d (%s): %llu frames decoded, %llu shown, "
+                "%llu dropped, %llu of %llu slices behind\n",
+                i, t->url,
+                (unsigned long long)t->decoded,
+                (unsigned long long)t->shown,
+                (unsigned long long)t->dropped,
+                (unsigned long long)t->late_slices,
+                (unsigned long long)t->slices);
+    }
+    fprintf(fp, "wall: %d decode workers, %llu slices stolen\n",
+            wall->pool.count, (unsigned long long)wall->pool.steals);
+}
+
+bool wall_run(const Options *opts) {
+    _cleanup_(wall_close) Wall wall = {};
+    wall.opts = *opts;
+    wall.count = opts->nb_urls;
+    if (wall.count > WALL_TILES_MAX) {
+        fprintf(stderr, "At most %d inputs fit on the wall\n",
+                WALL_TILES_MAX);
+        return false;
+    }
+    wall.cols = 1;
+    while (wall.cols * wall.cols < wall.count)
+        wall.cols++;
+    wall.rows = (wall.count + wall.cols - 1) / wall.cols;
+
+    // a worker per core, but no more than there are tiles
+    WallPool *pool = &wall.pool;
+    pool->count = min(max(SDL_GetCPUCount(), 1),
+            min(wall.count, WALL_WORKERS_MAX));
+    pool->mutex = SDL_CreateMutex();
+    pool->work = SDL_CreateCond();
+    if (!pool->mutex || !pool->work) {
+        LOG_ERROR("Error creating mutex/cond\n");
+        return false;
+    }
+    if (!open_tiles(&wall))
+        return false;
+
+    // the device is set up for the first tile, which is
+    // heard first; the others get converted to that
+    SDL_AudioSpec wanted_spec = {
+        .callback = NULL,
+        .samples  = opts->audio_buffer,
+    };
+    audio_wanted_spec(wall.tiles[0].param.audio_ctx, &wanted_spec);
+    if (opts->downmix && wanted_spec.channels > 2)
+        wanted_spec.channels = 2;
+    AVRational dar = display_aspect(&wall.tiles[0].param);
+    Rational aspect = {
+        .num = wall.cols * dar.num,
+        .den = wall.rows * dar.den,
+    };
+    if (!app_init(&wall.app, &wanted_spec, &aspect))
+        return false;
+    if (!audio_conv_init(&wall.audio_conv, &wall.app.audio_spec,
+                &wall.tiles[0].param.audio_ctx->ch_layout))
+        return false;
+    wall.tiles[0].heard = true;
+    layout(&wall);
+
+    for (int i = 0; i < pool->count; i++) {
+        pool->workers[i] = (WallWorker){ .wall = &wall, .index = i };
+        pool->threads[i] = SDL_CreateThread(
+                worker_main, "wall_worker", &pool->workers[i]);
+        if (!pool->threads[i]) {
+            LOG_ERROR("Error launching decode worker\n");
+            return false;
+        }
+    }
+    printf("Wall: %d inputs in a %dx%d grid, %d decode workers\n",
+            wall.count, wall.cols, wall.rows, pool->count);
+
+    wall.start = clock_now();
+    SDL_PauseAudioDevice(wall.app.audio_devID, 0);
+    while (!wall.done) {
+        int timeout = take_frames(&wall);
+        feed_audio(&wall);
+        if (!render(&wall))
+            return false;
+        // the audio needs topping up about once a device buffer
+        if (!wall.app.paused) {
+            int audio_ms = max((int)(wall.app.audio_latency / 1000), 1);
+            if (timeout < 0 || audio_ms < timeout)
+                timeout = audio_ms;
+        }
+
+        SDL_Event e;
+        int got = timeout < 0
+            ? SDL_WaitEvent(&e)
+            : SDL_WaitEventTimeout(&e, timeout);
+        for (; got; got = SDL_PollEvent(&e)) {
+            if (!handle_event(&wall, &e))
+                return false;
+        }
+    }
+    print_stats(&wall, stdout);
+    return true;
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "app.h"
+#include "audio.h"
+#include "opts.h"
+#include "param.h"
+#include "queue.h"
+
+#define WALL_TILES_MAX 64
+#define WALL_WORKERS_MAX 64
+
+struct SwsContext;
+
+// one input on the wall. Its decoding runs on whichever pool
+// worker picks it up, a slice at a time, and only one at a
+// time; frames come out already scaled to the tile
+typedef struct {
+    const char *url;
+    avparam_t param;
+    Queue video_queue;
+    Queue audio_queue;
+
+    // the worker side: like the fetch thread's, the decoder
+    // last read from and its stream, and the scaler
+    AVCodecContext *codec_ctx;
+    int stream_index;
+    struct SwsContext *sws;
+    // the file time this pass got up to, for looping
+    int64_t pass_end;
+
+    // set by the main thread with the pool locked, and picked
+    // up by the worker at the start of each slice: the size
+    // to scale to, whether the tile is heard, and whether it
+    // fell behind, which has the decoder skip frames nothing
+    // refers to
+    int width, height;
+    bool heard;
+    bool late;
+
+    // with the pool locked: whether the tile is on a worker's
+    // run list or being decoded, which worker last ran it, and
+    // whether it has nothing left to decode
+    bool scheduled;
+    int worker;
+    bool eof;
+
+    // the main thread side: the frame on screen, as a texture,
+    // where it goes, and what the tile's pts are relative to
+    // on the wall's clock
+    AVFrame *frame;
+    SDL_Texture *tex;
+    int tex_w, tex_h;
+    SDL_Rect rect;
+    int64_t base;
+    bool dirty;
+
+    uint64_t decoded, shown, dropped;
+    uint64_t slices, late_slices;
+} Tile;
+
+// a run list of tile indices, as a ring
+typedef struct {
+    int tiles[WALL_TILES_MAX];
+    int start, count;
+} WallRuns;
+
+typedef struct Wall Wall;
+
+typedef struct {
+    Wall *wall;
+    int index;
+} WallWorker;
+
+// the decode pool: each worker takes tiles off its own run list
+// first, then steals from the longest of the others; tiles go
+// back on the list of the worker that last ran them
+typedef struct {
+    SDL_mutex *mutex;
+    SDL_cond *work;
+    WallRuns runs[WALL_WORKERS_MAX];
+    WallWorker workers[WALL_WORKERS_MAX];
+    SDL_Thread *threads[WALL_WORKERS_MAX];
+    int count;
+    bool quit;
+    uint64_t steals;
+} WallPool;
+
+// several inputs playing at once in a grid, in one window, with
+// the audio of one of them at a time
+struct Wall {
+    Options opts;
+    Tile *tiles;
+    int count;
+    int cols, rows;
+    WallPool pool;
+    App app;
+    AudioConv audio_conv;
+    int heard;
+
+    // the wall's clock: clock_now() when it started, and the
+    // time spent paused since
+    int64_t start;
+    int64_t paused_at;
+    int64_t paused_time;
+    bool done;
+};
+
+// plays opts->urls as a wall until they're all done, or the
+// window gets closed; returns false on error
+bool wall_run(const Options *opts);